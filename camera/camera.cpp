@@ -1,25 +1,156 @@
 ﻿#include "camera.h"
+#include "capturereactor.h"
+#include "recorder.h"
 #include <unistd.h>
 #include <algorithm>
 
-Camera::Device::Device(int decodeType, const Camera::FnProcessImage &func)
-    :fd(-1),sampleTimeout(5),isRunning(0),decoder(nullptr)
+Camera::FrameSource::FrameSource(int decodeType, const Camera::FnProcessFrame &func)
+    :decoder(nullptr),frameRate(0),isRunning(0),recorder(nullptr)
 {
-    if (decodeType == Camera::Decode_ASYNC) {
-        decoder = new AsyncDecoder(func);
-    } else if (decodeType == Camera::Decode_PINGPONG) {
-        decoder = new PingPongDecoder(func);
-    } else {
-        decoder = new Decoder(func);
-    }
+    decoder = createDecoder(decodeType, func);
 }
 
-Camera::Device::~Device()
+Camera::FrameSource::~FrameSource()
+{
+    destroyDecoder();
+}
+
+void Camera::FrameSource::destroyDecoder()
 {
     if (decoder) {
         delete decoder;
         decoder = nullptr;
+        /* the frames of the decoder are free now */
+        FramePool::instance().trim();
+    }
+    return;
+}
+
+void Camera::FrameSource::dispatch(const FrameLease &lease)
+{
+    if (recorder != nullptr) {
+        recorder->record(lease.info, lease.data, lease.length);
     }
+    decoder->sample(lease);
+    return;
+}
+
+bool Camera::FrameSource::setPyramid(int levels)
+{
+    /* the frames in flight are sized for the current levels */
+    if (isRunning.load()) {
+        return false;
+    }
+    decoder->setPyramid(levels);
+    return true;
+}
+
+bool Camera::FrameSource::setDecodeThreads(int count)
+{
+    /* decode threads may be inside the restart decoder */
+    if (isRunning.load()) {
+        return false;
+    }
+    decoder->setDecodeThreads(count);
+    return true;
+}
+
+Camera::Device::Device(int decodeType, const Camera::FnProcessImage &func)
+    :Device(decodeType, toProcessFrame(func))
+{
+
+}
+
+Camera::Device::Device(int decodeType, const Camera::FnProcessFrame &func)
+    :FrameSource(decodeType, func),fd(-1),sampleTimeout(5),sampleMode(Sample_FIFO),
+      requestedBlockCount(defaultBlockCount),mmapBlockCount(0),reactor(nullptr)
+{
+    resetStatistics();
+}
+
+Camera::Device::~Device()
+{
+    /* decoder threads may hold leases of the buffers below */
+    destroyDecoder();
+}
+
+bool Camera::Device::validate(const FrameInfo &info, const unsigned char *data)
+{
+    statistics[Stat_CAPTURED]++;
+    int stat = -1;
+    if (info.error) {
+        stat = Stat_ERROR_FLAG;
+    } else if (info.pixelFormat == V4L2_PIX_FMT_MJPEG) {
+        int ret = Jpeg::validate(data, info.bytesused, info.width, info.height);
+        if (ret == Jpeg::CHECK_TRUNCATED || ret == Jpeg::CHECK_EOI) {
+            stat = Stat_TRUNCATED;
+        } else if (ret == Jpeg::CHECK_DIMENSION) {
+            stat = Stat_SIZE_MISMATCH;
+        } else if (ret != Jpeg::CHECK_OK) {
+            stat = Stat_CORRUPT;
+        }
+    } else if (info.bytesused < (unsigned int)info.bytesperline*info.height) {
+        stat = Stat_TRUNCATED;
+    }
+    if (stat < 0) {
+        return true;
+    }
+    statistics[stat]++;
+    statistics[Stat_DROPPED]++;
+    return false;
+}
+
+bool Camera::Device::grab(FrameLease &lease)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    // put cache from queue
+    if (ioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
+        if (errno != EAGAIN) {
+            perror("0 Fail to ioctl 'VIDIOC_DQBUF'");
+        }
+        return false;
+    }
+    if (sampleMode.load() == Sample_LATEST) {
+        /* drain the queue, only the newest frame goes to the decoder */
+        while (1) {
+            struct v4l2_buffer next;
+            memset(&next, 0, sizeof(next));
+            next.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            next.memory = V4L2_MEMORY_MMAP;
+            if (ioctl(fd, VIDIOC_DQBUF, &next) == -1) {
+                break;
+            }
+            /* the older frame was captured but is never decoded */
+            statistics[Stat_CAPTURED]++;
+            statistics[Stat_DROPPED]++;
+            if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+                perror("0 Fail to ioctl 'VIDIOC_QBUF'");
+            }
+            buf = next;
+        }
+    }
+    FrameInfo info = formatInfo;
+    info.timestamp = (long long)buf.timestamp.tv_sec*1000000 + buf.timestamp.tv_usec;
+    info.sequence = buf.sequence;
+    info.bytesused = buf.bytesused;
+    info.flags = buf.flags;
+    info.error = (buf.flags & V4L2_BUF_FLAG_ERROR) != 0;
+    if (buf.bytesused > sharedMem[buf.index].length) {
+        info.error = true;
+    }
+    /* drop bad frames before any decoder work is spent on them */
+    if (!validate(info, sharedMem[buf.index].data)) {
+        if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+            perror("0 Fail to ioctl 'VIDIOC_QBUF'");
+        }
+        return false;
+    }
+    /* lease: the buffer is queued again when the last reference drops */
+    lease = leasePool.acquire(buf.index, sharedMem[buf.index].data, info);
+    return true;
 }
 
 void Camera::Device::onSample()
@@ -45,20 +176,9 @@ void Camera::Device::onSample()
             fprintf(stderr,"select Timeout\n");
             continue;
         }
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        // put cache from queue
-        if (ioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
-            perror("0 Fail to ioctl 'VIDIOC_DQBUF'");
-            continue;
-        }
-        /* copy */
-        decoder->sample(sharedMem[buf.index].data, buf.bytesused);
-        /* dequeue */
-        if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
-            perror("0 Fail to ioctl 'VIDIOC_QBUF'");
+        FrameLease lease;
+        if (grab(lease)) {
+            dispatch(lease);
         }
     }
     printf("leave sampling function.\n");
@@ -67,7 +187,8 @@ void Camera::Device::onSample()
 
 int Camera::Device::openDevice(const std::string &path)
 {
-    int fd = open(path.c_str(), O_RDWR, 0);
+    /* non-blocking: select() waits, VIDIOC_DQBUF must not */
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK, 0);
     if (fd < 0) {
         perror("at Camera::Device::openDevice, fail to open device, error");
         return -1;
@@ -80,16 +201,140 @@ int Camera::Device::openDevice(const std::string &path)
         close(fd);
         return -2;
     }
-    /* frame */
+    return fd;
+}
+
+std::vector<Camera::FrameInterval> Camera::Device::enumFrameInterval(int fd, unsigned int pixelFormat, int w, int h)
+{
+    std::vector<Camera::FrameInterval> intervals;
+    struct v4l2_frmivalenum frmival;
+    memset(&frmival, 0, sizeof(frmival));
+    frmival.pixel_format = pixelFormat;
+    frmival.width = w;
+    frmival.height = h;
+    frmival.index = 0;
+    while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0) {
+        if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            intervals.push_back(FrameInterval{frmival.discrete.numerator, frmival.discrete.denominator});
+        } else {
+            /* stepwise or continuous: only the bounds */
+            intervals.push_back(FrameInterval{frmival.stepwise.min.numerator, frmival.stepwise.min.denominator});
+            intervals.push_back(FrameInterval{frmival.stepwise.max.numerator, frmival.stepwise.max.denominator});
+            break;
+        }
+        frmival.index++;
+    }
+    std::sort(intervals.begin(), intervals.end(), [](const FrameInterval &i1, const FrameInterval &i2){
+        return i1.fps() > i2.fps();
+    });
+    return intervals;
+}
+
+/* the interval of a stepwise or continuous range for fps: clamped, then snapped to the step */
+static Camera::FrameInterval fitFrameInterval(const v4l2_frmivalenum &frmival, double fps)
+{
+    const v4l2_fract &lo = frmival.stepwise.min;
+    const v4l2_fract &hi = frmival.stepwise.max;
+    const v4l2_fract &step = frmival.stepwise.step;
+    if (lo.denominator == 0 || hi.denominator == 0) {
+        return Camera::FrameInterval{0, 0};
+    }
+    double t = fps > 0 ? 1.0/fps : 0;
+    double tmin = double(lo.numerator)/lo.denominator;
+    double tmax = double(hi.numerator)/hi.denominator;
+    if (t <= tmin) {
+        return Camera::FrameInterval{lo.numerator, lo.denominator};
+    }
+    if (t >= tmax) {
+        return Camera::FrameInterval{hi.numerator, hi.denominator};
+    }
+    if (frmival.type != V4L2_FRMIVAL_TYPE_STEPWISE || step.numerator == 0 || step.denominator == 0) {
+        return Camera::FrameInterval{1000, (unsigned int)(fps*1000 + 0.5)};
+    }
+    /* min + k*step as one fraction, the first step not above the requested rate */
+    unsigned long long k = (unsigned long long)ceil((t - tmin)*step.denominator/step.numerator - 1e-6);
+    unsigned long long num = (unsigned long long)lo.numerator*step.denominator +
+            k*step.numerator*lo.denominator;
+    unsigned long long den = (unsigned long long)lo.denominator*step.denominator;
+    if (double(num)/den >= tmax) {
+        return Camera::FrameInterval{hi.numerator, hi.denominator};
+    }
+    unsigned long long a = num;
+    unsigned long long b = den;
+    while (b != 0) {
+        unsigned long long r = a % b;
+        a = b;
+        b = r;
+    }
+    num /= a;
+    den /= a;
+    while (num > 0xffffffffULL || den > 0xffffffffULL) {
+        num = (num + 1)/2;
+        den = (den + 1)/2;
+    }
+    return Camera::FrameInterval{(unsigned int)num, (unsigned int)den};
+}
+
+bool Camera::Device::setFrameRate(double fps)
+{
+    frameRate = 0;
     v4l2_streamparm streamParam;
     memset(&streamParam, 0, sizeof(struct v4l2_streamparm));
     streamParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    streamParam.parm.capture.timeperframe.numerator = 1;
-    streamParam.parm.capture.timeperframe.denominator = 2;
-    if (ioctl(fd, VIDIOC_S_PARM, &streamParam) == -1) {
-        perror("failed to set frame");
+    if (ioctl(fd, VIDIOC_G_PARM, &streamParam) == -1) {
+        perror("failed to get stream parameter");
+        return false;
     }
-    return fd;
+    if (!(streamParam.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        printf("frame rate is not adjustable\n");
+    } else {
+        struct v4l2_frmivalenum frmival;
+        memset(&frmival, 0, sizeof(frmival));
+        frmival.pixel_format = formatInfo.pixelFormat;
+        frmival.width = formatInfo.width;
+        frmival.height = formatInfo.height;
+        frmival.index = 0;
+        bool ranged = ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0 &&
+                frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE;
+        std::vector<FrameInterval> intervals;
+        if (!ranged) {
+            intervals = enumFrameInterval(fd, formatInfo.pixelFormat, formatInfo.width, formatInfo.height);
+        }
+        FrameInterval interval{0, 0};
+        if (ranged) {
+            /* any interval inside the range, not only its bounds */
+            interval = fitFrameInterval(frmival, fps);
+        } else if (!intervals.empty()) {
+            /* sorted from high to low: the first one not above the request */
+            interval = intervals.back();
+            for (std::size_t i = 0; i < intervals.size(); i++) {
+                if (fps <= 0 || intervals[i].fps() <= fps + 1e-3) {
+                    interval = intervals[i];
+                    break;
+                }
+            }
+        } else if (fps > 0) {
+            interval = FrameInterval{1000, (unsigned int)(fps*1000)};
+        }
+        if (interval.numerator != 0) {
+            streamParam.parm.capture.timeperframe.numerator = interval.numerator;
+            streamParam.parm.capture.timeperframe.denominator = interval.denominator;
+            if (ioctl(fd, VIDIOC_S_PARM, &streamParam) == -1) {
+                perror("failed to set frame rate");
+            }
+        }
+    }
+    /* read back what the driver applied */
+    memset(&streamParam, 0, sizeof(struct v4l2_streamparm));
+    streamParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(fd, VIDIOC_G_PARM, &streamParam) == -1) {
+        perror("failed to get stream parameter");
+        return false;
+    }
+    const v4l2_fract &timeperframe = streamParam.parm.capture.timeperframe;
+    frameRate = FrameInterval{timeperframe.numerator, timeperframe.denominator}.fps();
+    printf("frame rate: %.2f fps\n", frameRate);
+    return true;
 }
 
 bool Camera::Device::checkCapability()
@@ -140,8 +385,15 @@ bool Camera::Device::setFormat(int w, int h, const std::string &format)
         perror("VIDIOC_S_FMT set err");
         return false;
     }
+    formatInfo = FrameInfo();
+    formatInfo.pixelFormat = fmt.fmt.pix.pixelformat;
+    formatInfo.width = fmt.fmt.pix.width;
+    formatInfo.height = fmt.fmt.pix.height;
+    formatInfo.bytesperline = fmt.fmt.pix.bytesperline;
     /* allocate memory for image */
     decoder->setFormat(w, h, format);
+    /* blocks of the previous size are not used again */
+    FramePool::instance().trim();
     return true;
 }
 
@@ -149,7 +401,7 @@ bool Camera::Device::attachSharedMemory()
 {
     struct v4l2_requestbuffers reqbufs;
     memset(&reqbufs, 0, sizeof(reqbufs));
-    reqbufs.count = mmapBlockCount;
+    reqbufs.count = requestedBlockCount;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     reqbufs.memory = V4L2_MEMORY_MMAP;
     if (ioctl(fd, VIDIOC_REQBUFS, &reqbufs) == -1) {
@@ -158,8 +410,21 @@ bool Camera::Device::attachSharedMemory()
         fd = -1;
         return false;
     }
+    /* the driver may adjust the count */
+    if (reqbufs.count < 1) {
+        fprintf(stderr, "no buffer allocated by driver\n");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    if ((int)reqbufs.count != requestedBlockCount) {
+        fprintf(stderr, "driver adjusted buffer count %d to %u\n", requestedBlockCount, reqbufs.count);
+    }
+    /* the request is kept for the next open, only the mapping follows the driver */
+    mmapBlockCount = reqbufs.count;
+    sharedMem = std::vector<Frame>(mmapBlockCount);
     /* map kernel cache to user process */
-    for (std::size_t i = 0; i < mmapBlockCount; i++) {
+    for (int i = 0; i < mmapBlockCount; i++) {
         //stand for a frame
         struct v4l2_buffer buf;
         memset(&buf, 0, sizeof(buf));
@@ -184,8 +449,9 @@ bool Camera::Device::attachSharedMemory()
             return false;
         }
     }
+    leasePool.attach(fd, mmapBlockCount);
     /* put the kernel cache to a queue */
-    for (std::size_t i = 0; i < mmapBlockCount; i++) {
+    for (int i = 0; i < mmapBlockCount; i++) {
         struct v4l2_buffer buf;
         memset(&buf, 0, sizeof(buf));
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -202,11 +468,21 @@ bool Camera::Device::attachSharedMemory()
 
 void Camera::Device::dettachSharedMemory()
 {
-    for (std::size_t i = 0; i < mmapBlockCount; i++) {
+    /* consumers may still read from the mapped buffers, never unmap under a lease */
+    bool drained = leasePool.detach();
+    for (std::size_t i = 0; i < sharedMem.size(); i++) {
+        if (!drained && leasePool.held(i)) {
+            /* leaked lease: keep its mapping rather than block or crash the holder */
+            fprintf(stderr, "buffer %d of %s is still leased, its mapping is leaked\n",
+                    (int)i, devPath.c_str());
+            continue;
+        }
         if (munmap(sharedMem[i].data, sharedMem[i].length) == -1) {
             perror("Fail to munmap");
         }
     }
+    sharedMem.clear();
+    mmapBlockCount = 0;
     return;
 }
 
@@ -216,15 +492,24 @@ bool Camera::Device::startSample()
         return true;
     }
     v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    leasePool.setStreaming(true);
     if (ioctl(fd, VIDIOC_STREAMON, &type) == -1) {
         perror("VIDIOC_STREAMON");
         closeDevice();
         return false;
     }
-    /* start thread */
     isRunning.store(1);
-    sampleThread = std::thread(&Camera::Device::onSample, this);
     decoder->start();
+    if (reactor != nullptr) {
+        /* the reactor thread samples for us */
+        if (reactor->add(this) == false) {
+            stopSample();
+            return false;
+        }
+        return true;
+    }
+    /* start thread */
+    sampleThread = std::thread(&Camera::Device::onSample, this);
     return true;
 }
 
@@ -232,12 +517,19 @@ bool Camera::Device::stopSample()
 {
     if (isRunning.load()) {
         isRunning.store(0);
+        if (reactor != nullptr) {
+            reactor->remove(this);
+        }
+        /* released leases must not be queued after stream off */
+        leasePool.setStreaming(false);
         v4l2_buf_type type;
         type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (ioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
             perror("Fail to ioctl 'VIDIOC_STREAMOFF'");
         }
-        sampleThread.join();
+        if (sampleThread.joinable()) {
+            sampleThread.join();
+        }
         decoder->stop();
     }
     return true;
@@ -245,6 +537,8 @@ bool Camera::Device::stopSample()
 
 void Camera::Device::closeDevice()
 {
+    /* the sample thread and the decoders drop their leases before the buffers go */
+    stopSample();
     /* dettach shared memory */
     dettachSharedMemory();
     /* close device */
@@ -433,7 +727,38 @@ std::vector<std::string> Camera::Device::getResolutionList(const std::string &pa
     return resList;
 }
 
-int Camera::Device::openPath(const std::string &path, const std::string &format, const std::string &res)
+std::vector<Camera::FrameInterval> Camera::Device::getFrameIntervalList(const std::string &path,
+                                                                        const std::string &pixelFormat,
+                                                                        const std::string &res)
+{
+    std::vector<Camera::FrameInterval> intervals;
+    std::vector<Camera::PixelFormat> pixelFormatList = Camera::Device::getPixelFormatList(path);
+    unsigned int pixelFormatInt = 0;
+    for (std::size_t i = 0; i < pixelFormatList.size(); i++) {
+        if (pixelFormatList[i].formatString == pixelFormat) {
+            pixelFormatInt = pixelFormatList[i].formatInt;
+            break;
+        }
+    }
+    if (pixelFormatInt == 0) {
+        return intervals;
+    }
+    std::vector<std::string> resList = Strings::split(res, "*");
+    if (resList.size() != 2) {
+        return intervals;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK, 0);
+    if (fd < 0) {
+        printf("fail to open device. fd = %d\n", fd);
+        return intervals;
+    }
+    intervals = enumFrameInterval(fd, pixelFormatInt,
+                                  std::atoi(resList[0].c_str()), std::atoi(resList[1].c_str()));
+    close(fd);
+    return intervals;
+}
+
+int Camera::Device::openPath(const std::string &path, const std::string &format, const std::string &res, double fps)
 {
     fd = openDevice(path);
     if (fd < 0) {
@@ -448,6 +773,8 @@ int Camera::Device::openPath(const std::string &path, const std::string &format,
         printf("failed to setFormat.\n");
         return -4;
     }
+    /* frame rate */
+    setFrameRate(fps);
     /* attach shared memory */
     if (attachSharedMemory() == false) {
         printf("fail to attachSharedMemory\n");
@@ -461,7 +788,7 @@ int Camera::Device::openPath(const std::string &path, const std::string &format,
     return 0;
 }
 
-int Camera::Device::start(const std::string &path, const std::string &format, const std::string &res)
+int Camera::Device::start(const std::string &path, const std::string &format, const std::string &res, double fps)
 {
     if (format.empty()) {
         printf("Camera::Device::start: empty format\n");
@@ -472,10 +799,10 @@ int Camera::Device::start(const std::string &path, const std::string &format, co
         return -7;
     }
     devPath = path;
-    return openPath(devPath, format, res);
+    return openPath(devPath, format, res, fps);
 }
 
-int Camera::Device::start(unsigned short vid, unsigned short pid, const std::string &pixelFormat, int resIndex)
+int Camera::Device::start(unsigned short vid, unsigned short pid, const std::string &pixelFormat, int resIndex, double fps)
 {
     /* enumerate */
     std::vector<Camera::Property> devList = Camera::Device::enumerate();
@@ -508,7 +835,7 @@ int Camera::Device::start(unsigned short vid, unsigned short pid, const std::str
     }
     resolutionMap[pixelFormat] = resList;
     devPath = dev.path;
-    return openPath(dev.path, pixelFormat, resList[resIndex]);
+    return openPath(dev.path, pixelFormat, resList[resIndex], fps);
 }
 
 void Camera::Device::stop()
@@ -528,10 +855,55 @@ void Camera::Device::clear()
     return;
 }
 
-void Camera::Device::restart(const std::string &format, const std::string &res)
+void Camera::Device::restart(const std::string &format, const std::string &res, double fps)
 {
     stop();
-    start(devPath, format, res);
+    start(devPath, format, res, fps);
+    return;
+}
+
+void Camera::Device::setReactor(CaptureReactor *reactor_)
+{
+    if (isRunning.load()) {
+        return;
+    }
+    reactor = reactor_;
+    return;
+}
+
+void Camera::Device::setBufferCount(int count)
+{
+    int adjusted = std::max(2, std::min(count, (int)maxBlockCount));
+    if (adjusted != count) {
+        fprintf(stderr, "buffer count %d adjusted to %d\n", count, adjusted);
+    }
+    requestedBlockCount = adjusted;
+    return;
+}
+
+Camera::FrameStatistics Camera::Device::getStatistics() const
+{
+    FrameStatistics stat;
+    stat.captured = statistics[Stat_CAPTURED].load();
+    stat.dropped = statistics[Stat_DROPPED].load();
+    stat.errorFlag = statistics[Stat_ERROR_FLAG].load();
+    stat.truncated = statistics[Stat_TRUNCATED].load();
+    stat.corrupt = statistics[Stat_CORRUPT].load();
+    stat.sizeMismatch = statistics[Stat_SIZE_MISMATCH].load();
+    return stat;
+}
+
+void Camera::Device::resetStatistics()
+{
+    for (int i = 0; i < Stat_COUNT; i++) {
+        statistics[i].store(0);
+    }
+    return;
+}
+
+void Camera::Device::setSampleMode(int mode)
+{
+    sampleMode.store(mode);
     return;
 }
 
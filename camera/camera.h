@@ -13,6 +13,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <linux/types.h>
 #include <linux/videodev2.h>
 #include <stdarg.h>
@@ -25,9 +26,14 @@
 #include <set>
 #include <map>
 #include <iostream>
+#include <algorithm>
 #include "libyuv.h"
 #include "jpegwrap.h"
 #include "strings.hpp"
+#include "framelease.h"
+#include "framepool.h"
+#include "pixelconvert.h"
+#include "restartdecoder.h"
 
 #define CAMERA_PIXELFORMAT_YUYV "YUYV"
 #define CAMERA_PIXELFORMAT_JPEG "JPEG"
@@ -43,7 +49,20 @@ enum Code {
 enum DecodeType {
     Decode_SYNC = 0,
     Decode_ASYNC,
-    Decode_PINGPONG
+    Decode_PINGPONG,
+    Decode_POOL
+};
+
+/* pixel format of the capture, selects the decode kernel */
+enum InputFormat {
+    Input_NONE = 0,
+    Input_JPEG,
+    Input_YUYV
+};
+
+enum SampleMode {
+    Sample_FIFO = 0,
+    Sample_LATEST
 };
 
 enum ParamFlag {
@@ -108,40 +127,57 @@ struct PixelFormat {
     unsigned int formatInt;
 };
 
+/* timeperframe, fps = denominator/numerator */
+struct FrameInterval {
+    unsigned int numerator;
+    unsigned int denominator;
+    double fps() const {return numerator == 0 ? 0 : double(denominator)/numerator;}
+};
+
 
+/* frame memory from the shared FramePool, returned when the frame is cleared or destroyed */
 class Frame
 {
 public:
     unsigned char* data;
     unsigned long length;
     unsigned long capacity;
+protected:
+    FrameBuffer buffer;
 public:
-    static unsigned long align(unsigned long s)
+    Frame():data(nullptr), length(0), capacity(0){}
+    Frame(const Frame &r) = delete;
+    Frame& operator=(const Frame &r) = delete;
+    Frame(Frame &&r)
+        :data(r.data),length(r.length),capacity(r.capacity),buffer(std::move(r.buffer))
+    {
+        r.data = nullptr;
+        r.length = 0;
+        r.capacity = 0;
+    }
+    Frame& operator=(Frame &&r)
     {
-        unsigned long size = s;
-        if (size&0x3ff) {
-            size = ((size >> 10) + 1)<<10;
+        if (this != &r) {
+            buffer = std::move(r.buffer);
+            data = r.data;
+            length = r.length;
+            capacity = r.capacity;
+            r.data = nullptr;
+            r.length = 0;
+            r.capacity = 0;
         }
-        return size;
+        return *this;
     }
-    Frame():data(nullptr), length(0), capacity(0){}
     ~Frame(){}
     void allocate(unsigned long size)
     {
-        if (data == nullptr) {
-            capacity = align(size);
-            length = size;
-            data = new unsigned char[capacity];
-        } else {
-            if (size > capacity) {
-                delete [] data;
-                capacity = align(size);
-                length = size;
-                data = new unsigned char[capacity];
-            } else {
-                length = size;
-            }
+        if (size > capacity) {
+            /* contents are not kept */
+            buffer = FramePool::instance().acquire(size);
+            data = buffer.data;
+            capacity = buffer.capacity;
         }
+        length = data == nullptr ? 0 : size;
         return;
     }
     void copy(unsigned char *d, unsigned long s)
@@ -152,33 +188,555 @@ public:
     }
     void clear()
     {
-        if (data) {
-            delete [] data;
-            data = nullptr;
-        }
+        buffer.reset();
+        data = nullptr;
         length = 0;
         capacity = 0;
         return;
     }
 };
 
+/* rectangle of the sensor image in pixels */
+struct Region {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/* one image of a pyramid, in the format of its FrameDesc */
+struct FrameLevel {
+    int width;
+    int height;
+    int stride;
+    unsigned char* data;
+};
+
+/* decoded image plus the capture metadata of its source buffer */
+struct FrameDesc {
+    constexpr static int max_level = 4;
+    int width;
+    int height;
+    int channels;
+    int stride;         /* of the first plane */
+    int format;         /* OutputFormat */
+    unsigned char* data;
+    FrameInfo info;
+    /* levels[0] is the image above, each further level halves the previous one */
+    int levelCount;
+    FrameLevel levels[max_level];
+    const FrameLevel& level(int i) const
+    {
+        return levels[i < levelCount ? i : levelCount - 1];
+    }
+};
+
 using FnProcessImage = std::function<void(int, int, int, unsigned char*)>;
+using FnProcessFrame = std::function<void(const FrameDesc&)>;
 
 class IDecoder
 {
+public:
+    /* one specialization per input and output format */
+    using Kernel = bool (*)(const IDecoder &decoder, const FrameLease &input, Frame &frame, FrameDesc &output);
+    /* scratch of a decoding thread, shared by every kernel */
+    struct Workspace {
+        Jpeg::Decompressor decompressor;
+        std::vector<unsigned char> planes;
+        std::vector<unsigned char> scaledPlanes;
+        std::vector<unsigned char> scratch;
+        /* libjpeg rows before resizing */
+        std::vector<unsigned char> scaled;
+        /* region rows before resizing and conversion */
+        std::vector<unsigned char> cropped;
+        std::vector<unsigned char> resized;
+        /* resampled chroma of NV12 output */
+        std::vector<unsigned char> chroma;
+    };
 protected:
     int width;
     int height;
     std::string formatString;
-    FnProcessImage processImage;
+    int inputFormat;
+    /* chosen in setFormat() and setOutputFormat(), never per frame */
+    std::atomic<Kernel> kernel;
+    FnProcessFrame processFrame;
+    /* requested output size, w<<16|h, 0: native */
+    std::atomic<unsigned int> outputSize;
+    std::atomic<int> outputFormat;
+    /* decoded part of the sensor, x<<48|y<<32|w<<16|h, 0: full frame */
+    std::atomic<unsigned long long> regionOfInterest;
+protected:
+    /* extra halved levels built after each decode, frames are sized for them */
+    int pyramidLevels;
+    /* levels asked by setPyramid(), applied by the next configure() */
+    std::atomic<int> pyramidRequest;
+    /* intra-frame MJPEG decode threads, null: serial */
+    std::unique_ptr<RestartDecoder> restartDecoder;
+    /* threads asked by setDecodeThreads(), applied by the next configure() */
+    std::atomic<int> decodeThreads;
+protected:
+    /* room for every format at w*h */
+    static unsigned long levelLength(int w, int h)
+    {
+        return std::max(PixelConvert::length(Output_RGB24, w, h),
+                        PixelConvert::length(Output_BGRA, w, h));
+    }
+
+    /* output never exceeds the native size, buffers fit every format and level at that size */
+    unsigned long outputLength() const
+    {
+        unsigned long length = 0;
+        int w = width;
+        int h = height;
+        for (int i = 0; i <= pyramidLevels; i++) {
+            length += levelLength(w, h);
+            w = (w + 1)/2;
+            h = (h + 1)/2;
+        }
+        return length;
+    }
+
+    /* copies of the input: YUYV size, MJPEG payloads stay below it */
+    unsigned long inputLength() const
+    {
+        return (unsigned long)((width + 1)/2)*4*height;
+    }
+
+    /* each level is scaled from the previous one while it is still in cache */
+    void buildPyramid(Frame &frame, FrameDesc &output) const
+    {
+        FrameLevel *level = output.levels;
+        level->width = output.width;
+        level->height = output.height;
+        level->stride = output.stride;
+        level->data = output.data;
+        output.levelCount = 1;
+        unsigned char* data = frame.data;
+        int w = width;
+        int h = height;
+        for (int i = 1; i <= pyramidLevels; i++) {
+            /* offsets follow the native layout of outputLength() */
+            data += levelLength(w, h);
+            w = (w + 1)/2;
+            h = (h + 1)/2;
+            FrameLevel *next = level + 1;
+            next->width = (level->width + 1)/2;
+            next->height = (level->height + 1)/2;
+            next->stride = PixelConvert::stride(output.format, next->width);
+            next->data = data;
+            PixelConvert::scale(output.format, level->data, level->width, level->height, level->stride,
+                                next->data, next->width, next->height, next->stride,
+                                libyuv::kFilterBox);
+            level = next;
+            output.levelCount++;
+        }
+        return;
+    }
+
+    /* clamped to the frame, the full frame when unset */
+    void getRegion(Region &region) const
+    {
+        unsigned long long roi = regionOfInterest.load(std::memory_order_relaxed);
+        region.x = (roi >> 48) & 0xffff;
+        region.y = (roi >> 32) & 0xffff;
+        region.width = (roi >> 16) & 0xffff;
+        region.height = roi & 0xffff;
+        if (region.width == 0 || region.height == 0 || region.x >= width || region.y >= height) {
+            region.x = 0;
+            region.y = 0;
+            region.width = width;
+            region.height = height;
+        } else {
+            region.width = std::min(region.width, width - region.x);
+            region.height = std::min(region.height, height - region.y);
+        }
+        return;
+    }
+
+    /* the region at its own size unless a size up to the native one is requested */
+    void getOutputSize(const Region &region, int &w, int &h) const
+    {
+        unsigned int size = outputSize.load(std::memory_order_relaxed);
+        w = size >> 16;
+        h = size & 0xffff;
+        if (w <= 0 || w > width || h <= 0 || h > height) {
+            w = region.width;
+            h = region.height;
+        }
+        return;
+    }
+
+    /* largest libjpeg scale_denom that still covers the requested size */
+    static int selectScale(int w, int h, int outputWidth, int outputHeight)
+    {
+        for (int scale = Jpeg::SCALE_D8; scale > Jpeg::SCALE_D1; scale /= 2) {
+            if ((w + scale - 1)/scale >= outputWidth && (h + scale - 1)/scale >= outputHeight) {
+                return scale;
+            }
+        }
+        return Jpeg::SCALE_D1;
+    }
+
+
+    /* libjpeg's own output, R,G,B rows or luma rows (channels 1) */
+    bool decodeRows(Workspace &ws, const FrameLease &input, int channels,
+                    int scale, int outputWidth, int outputHeight,
+                    unsigned char* dst, std::size_t capacity) const
+    {
+        std::vector<unsigned char> &scaled = ws.scaled;
+        int scaledWidth = (width + scale - 1)/scale;
+        int scaledHeight = (height + scale - 1)/scale;
+        bool resize = scaledWidth != outputWidth || scaledHeight != outputHeight;
+        unsigned char* rows = dst;
+        if (resize) {
+            capacity = Jpeg::align4(scaledWidth, channels)*scaledHeight;
+            if (scaled.size() < capacity) {
+                scaled.resize(capacity);
+            }
+            rows = scaled.data();
+        }
+        int w = 0;
+        int h = 0;
+        int ret = 0;
+        if (channels == 1) {
+            ret = ws.decompressor.decodeGray(rows, w, h, input.data, input.length,
+                                             scale, Jpeg::ALIGN_4, capacity);
+        } else {
+            ret = ws.decompressor.decode(rows, w, h, input.data, input.length,
+                                         scale, Jpeg::ALIGN_4, capacity);
+        }
+        if (ret != 0 || w != scaledWidth || h != scaledHeight) {
+            return false;
+        }
+        if (resize && channels == 1) {
+            libyuv::ScalePlane(rows, Jpeg::align4(w, 1), w, h,
+                               dst, Jpeg::align4(outputWidth, 1), outputWidth, outputHeight,
+                               libyuv::kFilterBilinear);
+        } else if (resize) {
+            libyuv::RGBScale(rows, Jpeg::align4(w, 3), w, h,
+                             dst, Jpeg::align4(outputWidth, 3), outputWidth, outputHeight,
+                             libyuv::kFilterBilinear);
+        }
+        return true;
+    }
+
+    /* MJPEG region: rows above are skipped, columns outside are cropped before the IDCT */
+    bool decodeCrop(Workspace &ws, const FrameLease &input, const Region &region,
+                    int format, int outputWidth, int outputHeight, unsigned char* dst) const
+    {
+        std::vector<unsigned char> &cropped = ws.cropped;
+        std::vector<unsigned char> &resized = ws.resized;
+        int channels = format == Output_GRAY8 ? 1 : 3;
+        bool direct = format == Output_GRAY8 || format == Output_RGB24;
+        int scale = selectScale(region.width, region.height, outputWidth, outputHeight);
+        int x = region.x/scale;
+        int y = region.y/scale;
+        int w = std::max(region.width/scale, 1);
+        int h = std::max(region.height/scale, 1);
+        int stride = Jpeg::align4(w, channels);
+        unsigned char* rows = dst;
+        if (!direct || w != outputWidth || h != outputHeight) {
+            if (cropped.size() < std::size_t(stride)*h) {
+                cropped.resize(std::size_t(stride)*h);
+            }
+            rows = cropped.data();
+        }
+        if (ws.decompressor.decodeRegion(rows, stride, x, y, w, h,
+                                         input.data, input.length, scale, channels) != 0) {
+            return false;
+        }
+        if (w != outputWidth || h != outputHeight) {
+            int outputStride = Jpeg::align4(outputWidth, channels);
+            unsigned char* target = dst;
+            if (!direct) {
+                if (resized.size() < std::size_t(outputStride)*outputHeight) {
+                    resized.resize(std::size_t(outputStride)*outputHeight);
+                }
+                target = resized.data();
+            }
+            if (channels == 1) {
+                libyuv::ScalePlane(rows, stride, w, h, target, outputStride, outputWidth, outputHeight,
+                                   libyuv::kFilterBilinear);
+            } else {
+                libyuv::RGBScale(rows, stride, w, h, target, outputStride, outputWidth, outputHeight,
+                                 libyuv::kFilterBilinear);
+            }
+            rows = target;
+        }
+        if (!direct) {
+            PixelConvert::fromRGB(rows, outputWidth, outputHeight, format, dst, ws.scratch);
+        }
+        return true;
+    }
+
+    static Workspace& workspace()
+    {
+        static thread_local Workspace ws;
+        return ws;
+    }
+
+    void describe(const FrameLease &input, Frame &frame, int format,
+                  int outputWidth, int outputHeight, FrameDesc &output) const
+    {
+        output.width = outputWidth;
+        output.height = outputHeight;
+        output.format = format;
+        output.channels = PixelConvert::channels(format);
+        output.stride = PixelConvert::stride(format, outputWidth);
+        output.data = frame.data;
+        output.info = input.info;
+        return;
+    }
+
+    template<int format>
+    bool decodeJpeg(const FrameLease &input, Frame &frame, FrameDesc &output) const
+    {
+        /* libjpeg state is reused by every frame decoded on this thread */
+        Workspace &ws = workspace();
+        Region region;
+        getRegion(region);
+        int outputWidth = 0;
+        int outputHeight = 0;
+        getOutputSize(region, outputWidth, outputHeight);
+        describe(input, frame, format, outputWidth, outputHeight, output);
+        if (region.width != width || region.height != height) {
+            return decodeCrop(ws, input, region, format, outputWidth, outputHeight, frame.data);
+        }
+        /* shrink in the IDCT first */
+        int scale = selectScale(width, height, outputWidth, outputHeight);
+        if (format == Output_GRAY8) {
+            /* luma only: no chroma IDCT, upsampling or color conversion */
+            return decodeRows(ws, input, 1, scale, outputWidth, outputHeight,
+                              frame.data, frame.capacity);
+        }
+        Jpeg::Planar yuv;
+        int ret = 1;
+        if (restartDecoder) {
+            /* MCU-row bands on several cores when the camera emits restart markers */
+            ret = restartDecoder->decodeYUV(ws.decompressor, yuv, ws.planes, input.data, input.length, scale);
+        }
+        if (ret > 0) {
+            ret = ws.decompressor.decodeYUV(yuv, input.data, input.length, scale);
+        }
+        if (ret == -5) {
+            std::size_t length = Jpeg::align4(outputWidth, 3)*outputHeight;
+            if (ws.planes.size() < length) {
+                ws.planes.resize(length);
+            }
+            if (!decodeRows(ws, input, 3, scale, outputWidth, outputHeight,
+                            ws.planes.data(), ws.planes.size())) {
+                return false;
+            }
+            PixelConvert::fromRGB(ws.planes.data(), outputWidth, outputHeight, format, frame.data, ws.scratch);
+            return true;
+        } else if (ret != 0 ||
+                   yuv.width != (width + scale - 1)/scale ||
+                   yuv.height != (height + scale - 1)/scale) {
+            return false;
+        }
+        if (yuv.width != outputWidth || yuv.height != outputHeight) {
+            Jpeg::Planar resized;
+            PixelConvert::scalePlanar(yuv, resized, ws.scaledPlanes, outputWidth, outputHeight);
+            yuv = resized;
+        }
+        /* one libyuv pass replaces libjpeg's scalar color conversion */
+        PixelConvert::fromPlanar(yuv, true, format, frame.data, &ws.chroma);
+        return true;
+    }
+
+    template<int format>
+    bool decodeYUYV(const FrameLease &input, Frame &frame, FrameDesc &output) const
+    {
+        Workspace &ws = workspace();
+        Region region;
+        getRegion(region);
+        int outputWidth = 0;
+        int outputHeight = 0;
+        getOutputSize(region, outputWidth, outputHeight);
+        describe(input, frame, format, outputWidth, outputHeight, output);
+        int srcStride = (width + 1)/2*4;
+        if (input.length < (unsigned long)srcStride*height) {
+            return false;
+        }
+        /* only the rows and columns of the region are converted, pixel pairs share chroma */
+        region.x &= ~1;
+        const unsigned char* src = input.data + std::size_t(region.y)*srcStride + region.x*2;
+        int w = region.width;
+        int h = region.height;
+        if (outputWidth == w && outputHeight == h) {
+            PixelConvert::fromYUY2(src, w, h, format, frame.data, ws.planes, srcStride);
+        } else if (format == Output_GRAY8) {
+            /* deinterleave luma only, chroma is never touched */
+            std::size_t length = w*h;
+            if (ws.planes.size() < length) {
+                ws.planes.resize(length);
+            }
+            libyuv::YUY2ToY(src, srcStride, ws.planes.data(), w, w, h);
+            libyuv::ScalePlane(ws.planes.data(), w, w, h,
+                               frame.data, output.stride, outputWidth, outputHeight,
+                               libyuv::kFilterBilinear);
+        } else {
+            Jpeg::Planar yuv;
+            Jpeg::Planar resized;
+            PixelConvert::toPlanar(src, w, h, yuv, ws.planes, srcStride);
+            PixelConvert::scalePlanar(yuv, resized, ws.scaledPlanes, outputWidth, outputHeight);
+            PixelConvert::fromPlanar(resized, false, format, frame.data, &ws.chroma);
+        }
+        return true;
+    }
+
+    template<int input, int format>
+    static bool decodeKernel(const IDecoder &decoder, const FrameLease &in, Frame &frame, FrameDesc &output)
+    {
+        return input == Input_JPEG ? decoder.decodeJpeg<format>(in, frame, output) :
+                                     decoder.decodeYUYV<format>(in, frame, output);
+    }
+
+    /* NATIVE resolves to RGB24 for MJPEG and BGRA for YUYV */
+    static Kernel selectKernel(int input, int format)
+    {
+        static const Kernel jpegKernels[] = {
+            &decodeKernel<Input_JPEG, Output_RGB24>,
+            &decodeKernel<Input_JPEG, Output_RGB24>,
+            &decodeKernel<Input_JPEG, Output_BGR24>,
+            &decodeKernel<Input_JPEG, Output_BGRA>,
+            &decodeKernel<Input_JPEG, Output_GRAY8>,
+            &decodeKernel<Input_JPEG, Output_NV12>,
+            &decodeKernel<Input_JPEG, Output_I420>
+        };
+        static const Kernel yuyvKernels[] = {
+            &decodeKernel<Input_YUYV, Output_BGRA>,
+            &decodeKernel<Input_YUYV, Output_RGB24>,
+            &decodeKernel<Input_YUYV, Output_BGR24>,
+            &decodeKernel<Input_YUYV, Output_BGRA>,
+            &decodeKernel<Input_YUYV, Output_GRAY8>,
+            &decodeKernel<Input_YUYV, Output_NV12>,
+            &decodeKernel<Input_YUYV, Output_I420>
+        };
+        if (format < Output_NATIVE || format > Output_I420) {
+            return nullptr;
+        }
+        if (input == Input_JPEG) {
+            return jpegKernels[format];
+        } else if (input == Input_YUYV) {
+            return yuyvKernels[format];
+        }
+        return nullptr;
+    }
+
+    /* geometry and kernel, every setFormat() starts here */
+    void configure(int w, int h, const std::string &format)
+    {
+        width = w;
+        height = h;
+        formatString = format;
+        if (format == CAMERA_PIXELFORMAT_JPEG) {
+            inputFormat = Input_JPEG;
+        } else if (format == CAMERA_PIXELFORMAT_YUYV) {
+            inputFormat = Input_YUYV;
+        } else {
+            inputFormat = Input_NONE;
+        }
+        kernel.store(selectKernel(inputFormat, outputFormat.load()));
+        /* frames are allocated with outputLength() right after this */
+        pyramidLevels = pyramidRequest.load();
+        /* no frame is decoding while the format changes */
+        int threads = decodeThreads.load();
+        if (threads < 2) {
+            restartDecoder.reset();
+        } else if (!restartDecoder || restartDecoder->getThreadCount() != threads) {
+            restartDecoder.reset(new RestartDecoder(threads));
+        }
+        return;
+    }
+
+    /* shared by all decoders, safe to call from several threads with distinct frames */
+    bool decode(const FrameLease &input, Frame &frame, FrameDesc &output) const
+    {
+        Kernel decodeImage = kernel.load(std::memory_order_acquire);
+        if (decodeImage == nullptr) {
+            printf("decode failed. format: %s", formatString.c_str());
+            return false;
+        }
+        if (!decodeImage(*this, input, frame, output)) {
+            return false;
+        }
+        buildPyramid(frame, output);
+        return true;
+    }
 public:
-    IDecoder(){}
-    explicit IDecoder(const FnProcessImage &func):processImage(func){}
+    IDecoder()
+        :inputFormat(Input_NONE),kernel(nullptr),outputSize(0),outputFormat(Output_NATIVE),
+          regionOfInterest(0),pyramidLevels(0),pyramidRequest(0),decodeThreads(1){}
+    explicit IDecoder(const FnProcessFrame &func)
+        :inputFormat(Input_NONE),kernel(nullptr),processFrame(func),outputSize(0),outputFormat(Output_NATIVE),
+          regionOfInterest(0),pyramidLevels(0),pyramidRequest(0),decodeThreads(1){}
     virtual ~IDecoder(){}
 
+    /*
+        number of halved levels after the full image.
+        takes effect at the next setFormat(), which sizes the frames for them
+    */
+    void setPyramid(int levels)
+    {
+        pyramidRequest.store(std::max(0, std::min(levels, FrameDesc::max_level - 1)));
+        return;
+    }
+
+    /* threads decoding one MJPEG frame, 1: serial. takes effect at the next setFormat() */
+    void setDecodeThreads(int count)
+    {
+        decodeThreads.store(std::max(count, 1));
+        return;
+    }
+
+    /* OutputFormat handed to processFrame, may be changed while running */
+    void setOutputFormat(int format)
+    {
+        outputFormat.store(format);
+        kernel.store(selectKernel(inputFormat, format));
+        return;
+    }
+    int getOutputFormat() const {return outputFormat.load();}
+
+    /* deliver frames at w*h, 0*0: native size. may be changed while running */
+    void setOutputSize(int w, int h)
+    {
+        if (w <= 0 || h <= 0) {
+            outputSize.store(0);
+        } else {
+            outputSize.store((std::min(w, 0xffff) << 16) | std::min(h, 0xffff));
+        }
+        return;
+    }
+
+    /*
+        decode only x,y,w*h of the sensor image, w*h 0*0: full frame.
+        may be changed while running for digital zoom and pan,
+        frames are then delivered at the region size unless setOutputSize() asks otherwise.
+    */
+    void setROI(int x, int y, int w, int h)
+    {
+        if (x < 0 || y < 0 || w <= 0 || h <= 0) {
+            regionOfInterest.store(0);
+        } else {
+            regionOfInterest.store((static_cast<unsigned long long>(std::min(x, 0xffff)) << 48) |
+                                   (static_cast<unsigned long long>(std::min(y, 0xffff)) << 32) |
+                                   (static_cast<unsigned long long>(std::min(w, 0xffff)) << 16) |
+                                   std::min(h, 0xffff));
+        }
+        return;
+    }
+
     virtual void setFormat(int w, int h, const std::string &format){}
 
-    virtual void sample(unsigned char* data, unsigned long length){}
+    virtual void sample(unsigned char* data, unsigned long length)
+    {
+        sample(FrameLease(data, length));
+    }
+
+    virtual void sample(const FrameLease &lease){}
 
     virtual void run(){}
 
@@ -194,7 +752,7 @@ private:
     Frame outputFrame[4];
 public:
     Decoder():index(0){}
-    explicit Decoder(const FnProcessImage &func)
+    explicit Decoder(const FnProcessFrame &func)
         :IDecoder(func),index(0){}
     ~Decoder()
     {
@@ -204,38 +762,22 @@ public:
     }
     virtual void setFormat(int w, int h, const std::string &format) override
     {
-        width = w;
-        height = h;
-        formatString = format;
-        unsigned long length = width * height * 4;
-        if (formatString == CAMERA_PIXELFORMAT_JPEG) {
-            length = Jpeg::align4(width, 3)*height;
-        } else if (formatString == CAMERA_PIXELFORMAT_YUYV) {
-            length = width * height * 4;
-        }
+        configure(w, h, format);
+        unsigned long length = outputLength();
         for (int i = 0; i < 4; i++) {
             outputFrame[i].allocate(length);
         }
         return;
     }
 
-    virtual void sample(unsigned char* data, unsigned long length)
+    virtual void sample(const FrameLease &lease) override
     {
         Frame& frame = outputFrame[index];
         index = (index + 1)%4;
-        /* set format */
-        if (formatString == CAMERA_PIXELFORMAT_JPEG) {
-            Jpeg::decode(frame.data, width, height, data, length, Jpeg::ALIGN_4);
+        FrameDesc output;
+        if (decode(lease, frame, output)) {
             /* process */
-            processImage(height, width, 3, frame.data);
-        } else if(formatString == CAMERA_PIXELFORMAT_YUYV) {
-            int alignedWidth = (width + 1) & ~1;
-            libyuv::YUY2ToARGB(data, alignedWidth * 2,
-                    frame.data, width * 4,
-                    width, height);
-            processImage(height, width, 4, frame.data);
-        } else {
-            printf("decode failed. format: %s", formatString.c_str());
+            processFrame(output);
         }
         return;
     }
@@ -258,6 +800,7 @@ private:
     std::mutex mutex;
     std::thread processThread;
     Frame frameBuffer;
+    FrameLease inputLease;
     Frame outputFrame[4];
 protected:
     void run()
@@ -277,25 +820,19 @@ protected:
 
             state = STATE_PROCESSING;
 
-            Frame& inputFrame = frameBuffer;
+            FrameLease& inputFrame = inputLease;
             if (inputFrame.data == nullptr) {
                 continue;
             }
             Frame& frame = outputFrame[index];
             index = (index + 1)%4;
-            /* set format */
-            if (formatString == CAMERA_PIXELFORMAT_JPEG) {
-                Jpeg::decode(frame.data, width, height, inputFrame.data, inputFrame.length, Jpeg::ALIGN_4);
+            FrameDesc output;
+            bool ret = decode(inputFrame, frame, output);
+            /* give the kernel buffer back before processing */
+            inputFrame.reset();
+            if (ret) {
                 /* process */
-                processImage(height, width, 3, frame.data);
-            } else if(formatString == CAMERA_PIXELFORMAT_YUYV) {
-                int alignedWidth = (width + 1) & ~1;
-                libyuv::YUY2ToARGB(inputFrame.data, alignedWidth * 2,
-                    frame.data, width * 4,
-                    width, height);
-                processImage(height, width, 4, frame.data);
-            } else {
-                printf("decode failed. format: %s", formatString.c_str());
+                processFrame(output);
             }
 
             if (state != STATE_TERMINATE) {
@@ -309,7 +846,7 @@ protected:
     }
 public:
     AsyncDecoder():index(0),state(STATE_NONE){}
-    explicit AsyncDecoder(const FnProcessImage &func)
+    explicit AsyncDecoder(const FnProcessFrame &func)
         :IDecoder(func),index(0),state(STATE_NONE){}
     ~AsyncDecoder()
     {
@@ -321,27 +858,28 @@ public:
 
     virtual void setFormat(int w, int h, const std::string &format) override
     {
-        width = w;
-        height = h;
-        formatString = format;
-        unsigned long length = width * height * 4;
-        if (formatString == CAMERA_PIXELFORMAT_JPEG) {
-            length = Jpeg::align4(width, 3)*height;
-        } else if (formatString == CAMERA_PIXELFORMAT_YUYV) {
-            length = width * height * 4;
-        }
+        configure(w, h, format);
+        unsigned long length = outputLength();
         std::unique_lock<std::mutex> locker(mutex);
         for (int i = 0; i < 4; i++) {
             outputFrame[i].allocate(length);
         }
+        /* sized once, the copies in sample() never reallocate */
+        frameBuffer.allocate(inputLength());
         return;
     }
 
-    virtual void sample(unsigned char* data, unsigned long length) override
+    virtual void sample(const FrameLease &lease) override
     {
         if (state == STATE_PREPENDING) {
             std::unique_lock<std::mutex> locker(mutex);
-            frameBuffer.copy(data, length);
+            if (lease.retainable()) {
+                /* zero copy: hold the mmap'd buffer until decoded */
+                inputLease = lease;
+            } else {
+                frameBuffer.copy(lease.data, lease.length);
+                inputLease = FrameLease(frameBuffer.data, frameBuffer.length, lease.info);
+            }
             state = STATE_READY;
             condit.notify_all();
         }
@@ -372,86 +910,119 @@ public:
             });
         }
         processThread.join();
+        inputLease.reset();
         return;
     }
 
 };
 
+/*
+    single producer (sample) / single consumer (run) triple buffer.
+    the producer fills its back slot and swaps it with the pending one,
+    the consumer swaps its front slot with the pending one when it is fresh.
+    a pending frame that was not taken yet is the oldest one: it is
+    replaced by the newest and released, the consumer always decodes the
+    newest frame and sleeps on an eventfd while nothing is pending.
+*/
 class PingPongDecoder : public IDecoder
 {
 public:
-    constexpr static int max_buffer_len = 8;
+    constexpr static int max_buffer_len = 3;
+    /* set in pending while its slot holds a frame the consumer has not taken */
+    constexpr static int slot_fresh = 0x4;
+    constexpr static int slot_mask = 0x3;
 private:
-    int in;
-    int out;
+    int back;
+    int front;
+    std::atomic<int> pending;
     std::atomic<bool> isRunning;
+    std::atomic<unsigned long> droppedCount;
+    int eventFd;
     std::thread processThread;
-    Frame frameBuffer[8];
-    Frame outputFrame[8];
+    Frame frameBuffer[max_buffer_len];
+    FrameLease inputLease[max_buffer_len];
+    Frame outputFrame[max_buffer_len];
 protected:
+    void notify()
+    {
+        uint64_t value = 1;
+        if (write(eventFd, &value, sizeof(value)) != sizeof(value)) {
+            perror("PingPongDecoder: fail to write eventfd");
+        }
+        return;
+    }
+
     virtual void run() override
     {
         printf("enter process function.\n");
         while (isRunning.load()) {
-            int index = out;
-            Frame& inputFrame = frameBuffer[index];
-            if (inputFrame.data == nullptr) {
+            if (!(pending.load(std::memory_order_acquire) & slot_fresh)) {
+                /* nothing new: block until sample() or stop() signals */
+                uint64_t value = 0;
+                if (read(eventFd, &value, sizeof(value)) < 0 && errno != EINTR) {
+                    perror("PingPongDecoder: fail to read eventfd");
+                    break;
+                }
                 continue;
             }
-            Frame& frame = outputFrame[index];
-            /* set format */
-            if (formatString == CAMERA_PIXELFORMAT_JPEG) {
-                Jpeg::decode(frame.data, width, height, inputFrame.data, inputFrame.length, Jpeg::ALIGN_4);
+            /* take the newest frame, hand the decoded slot back */
+            front = pending.exchange(front, std::memory_order_acq_rel) & slot_mask;
+            FrameDesc output;
+            bool ret = decode(inputLease[front], outputFrame[front], output);
+            inputLease[front].reset();
+            if (ret) {
                 /* process */
-                processImage(height, width, 3, frame.data);
-            } else if(formatString == CAMERA_PIXELFORMAT_YUYV) {
-                int alignedWidth = (width + 1) & ~1;
-                libyuv::YUY2ToARGB(inputFrame.data, alignedWidth * 2,
-                    frame.data, width * 4,
-                    width, height);
-                processImage(height, width, 4, frame.data);
-            } else {
-                printf("decode failed. format: %s", formatString.c_str());
+                processFrame(output);
             }
-
         }
         printf("leave process function.\n");
         return;
     }
 public:
-    PingPongDecoder():in(0),out(0),isRunning(false){}
-    explicit PingPongDecoder(const FnProcessImage &func)
-        :IDecoder(func),in(0),out(0),isRunning(false){}
+    PingPongDecoder():back(0),front(1),pending(2),isRunning(false),droppedCount(0),eventFd(-1){}
+    explicit PingPongDecoder(const FnProcessFrame &func)
+        :IDecoder(func),back(0),front(1),pending(2),isRunning(false),droppedCount(0),eventFd(-1){}
     ~PingPongDecoder()
     {
-        for (int i = 0; i < 8; i++) {
+        stop();
+        for (int i = 0; i < max_buffer_len; i++) {
             frameBuffer[i].clear();
             outputFrame[i].clear();
         }
     }
 
+    unsigned long dropped() const {return droppedCount.load();}
+
     virtual void setFormat(int w, int h, const std::string &format) override
     {
-        width = w;
-        height = h;
-        formatString = format;
-        unsigned long length = width * height * 4;
-        if (formatString == CAMERA_PIXELFORMAT_JPEG) {
-            length = Jpeg::align4(width, 3)*height;
-        } else if (formatString == CAMERA_PIXELFORMAT_YUYV) {
-            length = width * height * 4;
-        }
-        for (int i = 0; i < 8; i++) {
+        configure(w, h, format);
+        unsigned long length = outputLength();
+        for (int i = 0; i < max_buffer_len; i++) {
             outputFrame[i].allocate(length);
+            frameBuffer[i].allocate(inputLength());
         }
         return;
     }
 
-    virtual void sample(unsigned char* data, unsigned long length) override
+    virtual void sample(const FrameLease &lease) override
     {
-        frameBuffer[in].copy(data, length);
-        out = in;
-        in = (in + 1)%8;
+        if (!isRunning.load()) {
+            return;
+        }
+        if (lease.retainable()) {
+            inputLease[back] = lease;
+        } else {
+            frameBuffer[back].copy(lease.data, lease.length);
+            inputLease[back] = FrameLease(frameBuffer[back].data, frameBuffer[back].length, lease.info);
+        }
+        int previous = pending.exchange(back | slot_fresh, std::memory_order_acq_rel);
+        back = previous & slot_mask;
+        if (previous & slot_fresh) {
+            /* the consumer never took it: release the oldest frame */
+            inputLease[back].reset();
+            droppedCount++;
+        }
+        notify();
         return;
     }
 
@@ -460,6 +1031,14 @@ public:
         if (isRunning.load()) {
             return;
         }
+        eventFd = eventfd(0, EFD_CLOEXEC);
+        if (eventFd < 0) {
+            perror("PingPongDecoder: eventfd");
+            return;
+        }
+        back = 0;
+        front = 1;
+        pending.store(2);
         isRunning.store(true);
         processThread = std::thread(&PingPongDecoder::run, this);
         return;
@@ -469,26 +1048,321 @@ public:
     {
         if (isRunning.load()) {
             isRunning.store(false);
+            notify();
             processThread.join();
+            close(eventFd);
+            eventFd = -1;
+            for (int i = 0; i < max_buffer_len; i++) {
+                inputLease[i].reset();
+            }
+        }
+        return;
+    }
+};
+
+/*
+    consecutive frames are decoded on N workers,
+    results are delivered to processFrame in capture order.
+*/
+class PoolDecoder : public IDecoder
+{
+public:
+    enum SlotState {
+        SLOT_FREE = 0,
+        SLOT_PENDING,
+        SLOT_DECODING,
+        SLOT_DONE,
+        SLOT_FAILED
+    };
+    struct Slot {
+        int state;
+        unsigned long ticket;
+        FrameLease input;
+        Frame inputFrame;
+        Frame outputFrame;
+        FrameDesc output;
+    };
+private:
+    int threadCount;
+    /* bounded in-flight window */
+    int windowSize;
+    unsigned long ticket;
+    bool delivering;
+    std::atomic<bool> isRunning;
+    std::atomic<unsigned long> droppedCount;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::vector<std::thread> workers;
+    std::vector<Slot> slots;
+protected:
+    int findSlot(int state) const
+    {
+        int index = -1;
+        for (std::size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].state == state &&
+                    (index < 0 || slots[i].ticket < slots[index].ticket)) {
+                index = i;
+            }
+        }
+        return index;
+    }
+
+    /* called with mutex held */
+    void deliver(std::unique_lock<std::mutex> &locker)
+    {
+        if (delivering) {
+            return;
+        }
+        delivering = true;
+        while (1) {
+            /* the oldest frame in flight goes first, missing tickets were dropped */
+            int index = -1;
+            for (std::size_t i = 0; i < slots.size(); i++) {
+                if (slots[i].state != SLOT_FREE &&
+                        (index < 0 || slots[i].ticket < slots[index].ticket)) {
+                    index = i;
+                }
+            }
+            if (index < 0) {
+                break;
+            }
+            Slot &slot = slots[index];
+            if (slot.state == SLOT_DONE) {
+                locker.unlock();
+                processFrame(slot.output);
+                locker.lock();
+            } else if (slot.state != SLOT_FAILED) {
+                break;
+            }
+            slot.state = SLOT_FREE;
+            condit.notify_all();
+        }
+        delivering = false;
+        return;
+    }
+
+    virtual void run() override
+    {
+        printf("enter pool process function.\n");
+        std::unique_lock<std::mutex> locker(mutex);
+        while (isRunning.load()) {
+            int index = findSlot(SLOT_PENDING);
+            if (index < 0) {
+                condit.wait(locker);
+                continue;
+            }
+            Slot &slot = slots[index];
+            slot.state = SLOT_DECODING;
+            locker.unlock();
+            bool ret = decode(slot.input, slot.outputFrame, slot.output);
+            slot.input.reset();
+            locker.lock();
+            slot.state = ret ? SLOT_DONE : SLOT_FAILED;
+            deliver(locker);
         }
+        printf("leave pool process function.\n");
         return;
     }
+public:
+    explicit PoolDecoder(const FnProcessFrame &func, int threadCount_=0, int windowSize_=0)
+        :IDecoder(func),threadCount(threadCount_),windowSize(windowSize_),
+          ticket(0),delivering(false),isRunning(false),droppedCount(0)
+    {
+        if (threadCount <= 0) {
+            threadCount = std::max(int(std::thread::hardware_concurrency()/2), 2);
+        }
+        if (windowSize < threadCount) {
+            windowSize = threadCount*2;
+        }
+        slots = std::vector<Slot>(windowSize);
+        for (std::size_t i = 0; i < slots.size(); i++) {
+            slots[i].state = SLOT_FREE;
+            slots[i].ticket = 0;
+        }
+    }
+    ~PoolDecoder()
+    {
+        stop();
+        for (std::size_t i = 0; i < slots.size(); i++) {
+            slots[i].inputFrame.clear();
+            slots[i].outputFrame.clear();
+        }
+    }
+
+    unsigned long dropped() const {return droppedCount.load();}
+
+    virtual void setFormat(int w, int h, const std::string &format) override
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        configure(w, h, format);
+        unsigned long length = outputLength();
+        for (std::size_t i = 0; i < slots.size(); i++) {
+            slots[i].outputFrame.allocate(length);
+            slots[i].inputFrame.allocate(inputLength());
+        }
+        return;
+    }
+
+    virtual void sample(const FrameLease &lease) override
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        int index = findSlot(SLOT_FREE);
+        if (index < 0) {
+            /* overload: replace the stalest frame not yet decoding */
+            index = findSlot(SLOT_PENDING);
+            if (index < 0) {
+                droppedCount++;
+                return;
+            }
+            droppedCount++;
+        }
+        Slot &slot = slots[index];
+        if (lease.retainable()) {
+            slot.input = lease;
+        } else {
+            slot.inputFrame.copy(lease.data, lease.length);
+            slot.input = FrameLease(slot.inputFrame.data, slot.inputFrame.length, lease.info);
+        }
+        slot.ticket = ticket++;
+        slot.state = SLOT_PENDING;
+        condit.notify_all();
+        return;
+    }
+
+    virtual void start() override
+    {
+        if (isRunning.load()) {
+            return;
+        }
+        isRunning.store(true);
+        for (int i = 0; i < threadCount; i++) {
+            workers.push_back(std::thread(&PoolDecoder::run, this));
+        }
+        return;
+    }
+
+    virtual void stop() override
+    {
+        if (!isRunning.load()) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            isRunning.store(false);
+            condit.notify_all();
+        }
+        for (std::size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+        workers.clear();
+        for (std::size_t i = 0; i < slots.size(); i++) {
+            slots[i].input.reset();
+            slots[i].state = SLOT_FREE;
+        }
+        return;
+    }
+};
+
+inline IDecoder* createDecoder(int decodeType, const FnProcessFrame &func)
+{
+    if (decodeType == Decode_ASYNC) {
+        return new AsyncDecoder(func);
+    } else if (decodeType == Decode_PINGPONG) {
+        return new PingPongDecoder(func);
+    } else if (decodeType == Decode_POOL) {
+        return new PoolDecoder(func);
+    }
+    return new Decoder(func);
+}
+
+inline FnProcessFrame toProcessFrame(const FnProcessImage &func)
+{
+    return [func](const FrameDesc &frame){
+        func(frame.height, frame.width, frame.channels, frame.data);
+    };
+}
+
+/* capture counters, frames failing validation or drained by Sample_LATEST never reach the decoder */
+struct FrameStatistics {
+    unsigned long captured;
+    unsigned long dropped;
+    unsigned long errorFlag;        /* V4L2_BUF_FLAG_ERROR */
+    unsigned long truncated;        /* short payload, missing EOI */
+    unsigned long corrupt;          /* missing SOI, broken marker segment */
+    unsigned long sizeMismatch;     /* SOF size differs from the negotiated one */
 };
 
-class Device
+class CaptureReactor;
+class Recorder;
+
+/*
+    decoder side shared by Device and VirtualDevice: leases go in through
+    dispatch(), decoded frames come out of the callback.
+*/
+class FrameSource
 {
+protected:
+    IDecoder *decoder;
+    double frameRate;
+    std::atomic<int> isRunning;
+    Recorder *recorder;
+protected:
+    /* the recorder sees the raw payload, then the decoder */
+    void dispatch(const FrameLease &lease);
+    /* before members the decoder threads may still use go away */
+    void destroyDecoder();
 public:
-    static constexpr int mmapBlockCount = 4;
+    explicit FrameSource(int decodeType, const FnProcessFrame &func);
+    virtual ~FrameSource();
+    virtual void stop() = 0;
+    virtual void restart(const std::string &format, const std::string &res, double fps) = 0;
+    /* rate applied by the driver */
+    double getFrameRate() const {return frameRate;}
+    /* raw payloads are written to the recorder before decoding */
+    void setRecorder(Recorder *recorder_) {recorder = recorder_;}
+    /* frames are shrunk while decoding, 0*0: native size */
+    void setOutputSize(int w, int h) {decoder->setOutputSize(w, h);}
+    /* OutputFormat delivered to consumers, Output_NATIVE by default */
+    void setOutputFormat(int format) {decoder->setOutputFormat(format);}
+    /* halved copies delivered with each frame in FrameDesc::levels, false while running */
+    bool setPyramid(int levels);
+    /* threads decoding one MJPEG frame, false while running */
+    bool setDecodeThreads(int count);
+    void setROI(int x, int y, int w, int h) {decoder->setROI(x, y, w, h);}
+};
+
+class Device : public FrameSource
+{
+    friend class CaptureReactor;
+public:
+    static constexpr int defaultBlockCount = 4;
+    static constexpr int maxBlockCount = 32;
 protected:
     /* device */
     int fd;
     std::string devPath;
-    IDecoder *decoder;
+    /* negotiated format */
+    FrameInfo formatInfo;
     /* sample */
     int sampleTimeout;
-    std::atomic<int> isRunning;
-    Frame sharedMem[mmapBlockCount];
+    std::atomic<int> sampleMode;
+    int requestedBlockCount;
+    int mmapBlockCount;         /* granted by the driver */
+    std::vector<Frame> sharedMem;
+    LeasePool leasePool;
     std::thread sampleThread;
+    CaptureReactor *reactor;
+    /* statistics */
+    enum Statistic {
+        Stat_CAPTURED = 0,
+        Stat_DROPPED,
+        Stat_ERROR_FLAG,
+        Stat_TRUNCATED,
+        Stat_CORRUPT,
+        Stat_SIZE_MISMATCH,
+        Stat_COUNT
+    };
+    std::atomic<unsigned long> statistics[Stat_COUNT];
     /* camera property */
     std::vector<PixelFormat> formatList;
     std::map<std::string, std::vector<std::string> > resolutionMap;
@@ -497,28 +1371,48 @@ protected:
     static unsigned short getVendorID(const char* name);
     static unsigned short getProductID(const char* name);
     static int openDevice(const std::string &path);
+    bool validate(const FrameInfo &info, const unsigned char* data);
+    bool grab(FrameLease &lease);
     void onSample();
     /* shared memory */
     bool attachSharedMemory();
     void dettachSharedMemory();
     bool checkCapability();
     bool setFormat(int w, int h, const std::string &format);
-    int openPath(const std::string &path, const std::string &format, const std::string &res);
+    static std::vector<FrameInterval> enumFrameInterval(int fd, unsigned int pixelFormat, int w, int h);
+    bool setFrameRate(double fps);
+    int openPath(const std::string &path, const std::string &format, const std::string &res, double fps);
     void closeDevice();
 public:
     explicit Device(int decodeType, const FnProcessImage &func);
+    explicit Device(int decodeType, const FnProcessFrame &func);
     ~Device();
     static std::vector<Property> enumerate();
     static std::vector<PixelFormat> getPixelFormatList(const std::string &path);
     static std::vector<std::string> getResolutionList(const std::string &path, const std::string &pixelFormat);
-    /* start - stop */
-    int start(const std::string &path, const std::string &format, const std::string &res);
-    int start(unsigned short vid, unsigned short pid, const std::string &pixelFormat, int resIndex=0);
-    void stop();
+    static std::vector<FrameInterval> getFrameIntervalList(const std::string &path,
+                                                           const std::string &pixelFormat,
+                                                           const std::string &res);
+    /* start - stop, fps <= 0: the highest rate supported by the resolution */
+    int start(const std::string &path, const std::string &format, const std::string &res, double fps=0);
+    int start(unsigned short vid, unsigned short pid, const std::string &pixelFormat, int resIndex=0, double fps=0);
+    virtual void stop() override;
     bool startSample();
     bool stopSample();
     void clear();
-    void restart(const std::string &format, const std::string &res);
+    virtual void restart(const std::string &format, const std::string &res, double fps=0) override;
+    /* sample on a shared reactor instead of a thread of its own, set before start */
+    void setReactor(CaptureReactor *reactor_);
+    /* queue depth, applied on next start */
+    void setBufferCount(int count);
+    int getBufferCount() const {return requestedBlockCount;}
+    /* buffers granted by the driver, 0 while closed */
+    int getMappedBufferCount() const {return mmapBlockCount;}
+    /* Sample_LATEST: drain ready buffers and only decode the newest one */
+    void setSampleMode(int mode);
+    int getSampleMode() const {return sampleMode.load();}
+    FrameStatistics getStatistics() const;
+    void resetStatistics();
     /* parameter */
     void setParam(unsigned int controlID, int value);
     int getParamRange(unsigned int controlID, int modeID, Param &param);
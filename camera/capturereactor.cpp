@@ -0,0 +1,292 @@
+#include "capturereactor.h"
+#include "camera.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <string.h>
+#include <algorithm>
+
+Camera::CaptureReactor::CaptureReactor(int workerCount_)
+    :epfd(-1),eventFd(-1),workerCount(std::max(workerCount_, 1)),isRunning(false),cycle(0)
+{
+
+}
+
+Camera::CaptureReactor::~CaptureReactor()
+{
+    stop();
+}
+
+void Camera::CaptureReactor::wakeup()
+{
+    uint64_t value = 1;
+    if (write(eventFd, &value, sizeof(value)) == -1) {
+        perror("CaptureReactor: fail to write eventfd");
+    }
+    return;
+}
+
+void Camera::CaptureReactor::run()
+{
+    printf("enter reactor function.\n");
+    struct epoll_event events[max_events];
+    while (isRunning.load()) {
+        int n = epoll_wait(epfd, events, max_events, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("Fail to epoll_wait");
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            Device *device = (Device*)events[i].data.ptr;
+            if (device == nullptr) {
+                /* stop or reconfigure */
+                uint64_t value = 0;
+                if (read(eventFd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                    perror("CaptureReactor: fail to read eventfd");
+                }
+                continue;
+            }
+            Worker *worker = nullptr;
+            {
+                std::unique_lock<std::mutex> locker(mutex);
+                auto it = deviceMap.find(device);
+                if (it == deviceMap.end() || it->second.lost) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    fprintf(stderr, "CaptureReactor: device %s lost\n", device->devPath.c_str());
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, device->fd, nullptr);
+                    /* kept until remove() so its queued tasks are still drained */
+                    it->second.lost = true;
+                    continue;
+                }
+                worker = workers[it->second.worker].get();
+            }
+            FrameLease lease;
+            if (device->grab(lease) == false) {
+                continue;
+            }
+            post(worker, device, lease);
+        }
+        std::unique_lock<std::mutex> locker(mutex);
+        cycle++;
+        condit.notify_all();
+    }
+    std::unique_lock<std::mutex> locker(mutex);
+    cycle++;
+    condit.notify_all();
+    printf("leave reactor function.\n");
+    return;
+}
+
+void Camera::CaptureReactor::post(Worker *worker, Device *device, FrameLease &lease)
+{
+    Task task;
+    task.device = device;
+    if (lease.retainable()) {
+        task.lease = std::move(lease);
+    } else {
+        /* the pool is running low: give the buffer back to the kernel now */
+        task.copy = FramePool::instance().acquire(lease.length);
+        if (task.copy.empty()) {
+            device->statistics[Device::Stat_DROPPED]++;
+            return;
+        }
+        memcpy(task.copy.data, lease.data, lease.length);
+        task.lease = FrameLease(task.copy.data, lease.length, lease.info);
+        lease.reset();
+    }
+    Task oldest;
+    {
+        std::unique_lock<std::mutex> locker(worker->mutex);
+        if ((int)worker->tasks.size() >= max_tasks) {
+            /* released outside the lock */
+            oldest = std::move(worker->tasks.front());
+            worker->tasks.pop_front();
+            oldest.device->statistics[Device::Stat_DROPPED]++;
+        }
+        worker->tasks.push_back(std::move(task));
+        worker->condit.notify_all();
+    }
+    return;
+}
+
+void Camera::CaptureReactor::work(Worker *worker)
+{
+    while (1) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> locker(worker->mutex);
+            worker->condit.wait(locker, [=]()->bool{
+                return !worker->isRunning || !worker->tasks.empty();
+            });
+            if (!worker->isRunning) {
+                break;
+            }
+            task = std::move(worker->tasks.front());
+            worker->tasks.pop_front();
+            worker->current = task.device;
+        }
+        task.device->dispatch(task.lease);
+        task.lease.reset();
+        task.copy.reset();
+        std::unique_lock<std::mutex> locker(worker->mutex);
+        worker->current = nullptr;
+        worker->condit.notify_all();
+    }
+    return;
+}
+
+int Camera::CaptureReactor::start()
+{
+    if (isRunning.load()) {
+        return 0;
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd == -1) {
+        perror("eventfd");
+        close(epfd);
+        epfd = -1;
+        return -2;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, eventFd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(eventFd);
+        close(epfd);
+        eventFd = -1;
+        epfd = -1;
+        return -3;
+    }
+    for (int i = 0; i < workerCount; i++) {
+        Worker *worker = new Worker;
+        worker->isRunning = true;
+        worker->current = nullptr;
+        worker->thread = std::thread(&CaptureReactor::work, this, worker);
+        workers.push_back(std::unique_ptr<Worker>(worker));
+    }
+    isRunning.store(true);
+    reactorThread = std::thread(&CaptureReactor::run, this);
+    return 0;
+}
+
+void Camera::CaptureReactor::stop()
+{
+    if (!isRunning.load()) {
+        return;
+    }
+    isRunning.store(false);
+    wakeup();
+    reactorThread.join();
+    for (std::size_t i = 0; i < workers.size(); i++) {
+        Worker *worker = workers[i].get();
+        {
+            std::unique_lock<std::mutex> locker(worker->mutex);
+            worker->isRunning = false;
+            worker->tasks.clear();
+            worker->condit.notify_all();
+        }
+        worker->thread.join();
+    }
+    std::unique_lock<std::mutex> locker(mutex);
+    workers.clear();
+    deviceMap.clear();
+    close(eventFd);
+    close(epfd);
+    eventFd = -1;
+    epfd = -1;
+    return;
+}
+
+bool Camera::CaptureReactor::add(Device *device)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (!isRunning.load()) {
+        return false;
+    }
+    auto it = deviceMap.find(device);
+    if (it != deviceMap.end() && !it->second.lost) {
+        return true;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = device;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, device->fd, &ev) == -1) {
+        perror("CaptureReactor: fail to add device");
+        return false;
+    }
+    if (it != deviceMap.end()) {
+        /* reopened after a loss, keeps its worker */
+        it->second.lost = false;
+        return true;
+    }
+    Entry entry;
+    entry.worker = leastLoadedWorker();
+    entry.lost = false;
+    deviceMap[device] = entry;
+    return true;
+}
+
+int Camera::CaptureReactor::leastLoadedWorker() const
+{
+    std::vector<int> load(workers.size(), 0);
+    for (auto it = deviceMap.begin(); it != deviceMap.end(); it++) {
+        load[it->second.worker]++;
+    }
+    return std::min_element(load.begin(), load.end()) - load.begin();
+}
+
+void Camera::CaptureReactor::remove(Device *device)
+{
+    int id = -1;
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        auto it = deviceMap.find(device);
+        if (it == deviceMap.end()) {
+            return;
+        }
+        id = it->second.worker;
+        if (!it->second.lost) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, device->fd, nullptr);
+        }
+        deviceMap.erase(it);
+        /* wait for the reactor to finish the events it already fetched */
+        if (isRunning.load() && std::this_thread::get_id() != reactorThread.get_id()) {
+            unsigned long current = cycle;
+            wakeup();
+            condit.wait(locker, [&]()->bool{
+                return cycle != current || !isRunning.load();
+            });
+        }
+    }
+    if (id < 0 || id >= (int)workers.size()) {
+        return;
+    }
+    Worker *worker = workers[id].get();
+    std::unique_lock<std::mutex> locker(worker->mutex);
+    for (auto it = worker->tasks.begin(); it != worker->tasks.end();) {
+        if (it->device == device) {
+            it = worker->tasks.erase(it);
+        } else {
+            it++;
+        }
+    }
+    if (std::this_thread::get_id() != worker->thread.get_id()) {
+        worker->condit.wait(locker, [=]()->bool{
+            return worker->current != device;
+        });
+    }
+    return;
+}
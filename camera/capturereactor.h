@@ -0,0 +1,79 @@
+#ifndef CAPTUREREACTOR_H
+#define CAPTUREREACTOR_H
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <map>
+#include "framelease.h"
+#include "framepool.h"
+
+namespace Camera {
+
+class Device;
+
+/*
+    one epoll thread sampling many devices, frames are never decoded on it.
+    a device always lands on the same worker of a shared pool, the one
+    serving the fewest devices when it was added. leases the pool cannot
+    spare are copied into the task, and a full worker queue drops its
+    oldest task so a slow worker cannot starve the buffers.
+*/
+class CaptureReactor
+{
+public:
+    constexpr static int max_events = 32;
+    /* tasks waiting per worker */
+    constexpr static int max_tasks = 4;
+    struct Task {
+        Device *device;
+        FrameLease lease;
+        /* holds the payload when the lease is a copy */
+        FrameBuffer copy;
+    };
+    struct Entry {
+        int worker;         /* index into workers */
+        bool lost;          /* EPOLLERR or EPOLLHUP, out of epoll until added again */
+    };
+    struct Worker {
+        bool isRunning;
+        Device *current;
+        std::deque<Task> tasks;
+        std::mutex mutex;
+        std::condition_variable condit;
+        std::thread thread;
+    };
+protected:
+    int epfd;
+    int eventFd;
+    int workerCount;
+    std::atomic<bool> isRunning;
+    unsigned long cycle;
+    std::map<Device*, Entry> deviceMap;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::thread reactorThread;
+    std::vector<std::unique_ptr<Worker> > workers;
+protected:
+    void run();
+    void work(Worker *worker);
+    /* lease is moved or copied into the task */
+    void post(Worker *worker, Device *device, FrameLease &lease);
+    void wakeup();
+    int leastLoadedWorker() const;
+public:
+    /* at least one worker */
+    explicit CaptureReactor(int workerCount_=1);
+    ~CaptureReactor();
+    int start();
+    void stop();
+    /* called by Device::startSample/stopSample */
+    bool add(Device *device);
+    void remove(Device *device);
+};
+
+}
+#endif // CAPTUREREACTOR_H
@@ -0,0 +1,185 @@
+#include "framelease.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <chrono>
+
+Camera::FrameLease::FrameLease(LeasePool *pool_, int index_, unsigned char *d, unsigned long len,
+                               const FrameInfo &info_, bool shared_)
+    :data(d),length(len),index(index_),info(info_),pool(pool_),shared(shared_)
+{
+
+}
+
+Camera::FrameLease::FrameLease(const Camera::FrameLease &r)
+    :data(r.data),length(r.length),index(r.index),info(r.info),pool(r.pool),shared(r.shared)
+{
+    if (pool) {
+        pool->retain(index);
+    }
+}
+
+Camera::FrameLease::FrameLease(Camera::FrameLease &&r)
+    :data(r.data),length(r.length),index(r.index),info(r.info),pool(r.pool),shared(r.shared)
+{
+    r.data = nullptr;
+    r.length = 0;
+    r.index = -1;
+    r.pool = nullptr;
+    r.shared = false;
+}
+
+Camera::FrameLease &Camera::FrameLease::operator=(const Camera::FrameLease &r)
+{
+    if (this == &r) {
+        return *this;
+    }
+    if (r.pool) {
+        r.pool->retain(r.index);
+    }
+    reset();
+    data = r.data;
+    length = r.length;
+    index = r.index;
+    info = r.info;
+    pool = r.pool;
+    shared = r.shared;
+    return *this;
+}
+
+Camera::FrameLease &Camera::FrameLease::operator=(Camera::FrameLease &&r)
+{
+    if (this == &r) {
+        return *this;
+    }
+    reset();
+    data = r.data;
+    length = r.length;
+    index = r.index;
+    info = r.info;
+    pool = r.pool;
+    shared = r.shared;
+    r.data = nullptr;
+    r.length = 0;
+    r.index = -1;
+    r.pool = nullptr;
+    r.shared = false;
+    return *this;
+}
+
+Camera::FrameLease::~FrameLease()
+{
+    reset();
+}
+
+void Camera::FrameLease::reset()
+{
+    if (pool) {
+        pool->release(index);
+    }
+    data = nullptr;
+    length = 0;
+    index = -1;
+    pool = nullptr;
+    shared = false;
+    return;
+}
+
+void Camera::LeasePool::queue(int index)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+        perror("LeasePool: Fail to ioctl 'VIDIOC_QBUF'");
+    }
+    return;
+}
+
+void Camera::LeasePool::attach(int fd_, int count_, int reserved_)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    fd = fd_;
+    count = count_;
+    reserved = reserved_ < count_ ? reserved_ : count_ - 1;
+    outstanding = 0;
+    streaming = false;
+    refs = std::unique_ptr<std::atomic<int>[]>(new std::atomic<int>[count]);
+    for (int i = 0; i < count; i++) {
+        refs[i].store(0);
+    }
+    return;
+}
+
+bool Camera::LeasePool::detach(int timeoutMs)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    streaming = false;
+    bool drained = true;
+    if (timeoutMs < 0) {
+        condit.wait(locker, [this]()->bool{
+            return outstanding == 0;
+        });
+    } else {
+        drained = condit.wait_for(locker, std::chrono::milliseconds(timeoutMs), [this]()->bool{
+            return outstanding == 0;
+        });
+    }
+    if (!drained) {
+        fprintf(stderr, "LeasePool: %d leases still held\n", outstanding);
+    }
+    fd = -1;
+    return drained;
+}
+
+void Camera::LeasePool::setStreaming(bool on)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    streaming = on;
+    return;
+}
+
+Camera::FrameLease Camera::LeasePool::acquire(int index, unsigned char *data, const FrameInfo &info)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    outstanding++;
+    refs[index].store(1);
+    /* keep enough buffers queued for the driver, otherwise consumers must copy */
+    bool shared = outstanding <= count - reserved;
+    return FrameLease(this, index, data, info.bytesused, info, shared);
+}
+
+void Camera::LeasePool::retain(int index)
+{
+    refs[index].fetch_add(1);
+    return;
+}
+
+void Camera::LeasePool::release(int index)
+{
+    if (refs[index].fetch_sub(1) != 1) {
+        return;
+    }
+    std::unique_lock<std::mutex> locker(mutex);
+    outstanding--;
+    if (streaming) {
+        queue(index);
+    }
+    condit.notify_all();
+    return;
+}
+
+int Camera::LeasePool::leased()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return outstanding;
+}
+
+bool Camera::LeasePool::held(int index)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return index >= 0 && index < count && refs[index].load() > 0;
+}
@@ -0,0 +1,91 @@
+#ifndef FRAMELEASE_H
+#define FRAMELEASE_H
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+namespace Camera {
+
+class LeasePool;
+
+/* capture metadata of a v4l2 buffer */
+struct FrameInfo {
+    long long timestamp;        /* capture time in us, CLOCK_MONOTONIC */
+    unsigned int sequence;
+    unsigned int bytesused;
+    unsigned int flags;         /* V4L2_BUF_FLAG_* */
+    unsigned int pixelFormat;   /* V4L2_PIX_FMT_* */
+    int width;
+    int height;
+    int bytesperline;
+    bool error;
+    FrameInfo():timestamp(0),sequence(0),bytesused(0),flags(0),pixelFormat(0),
+        width(0),height(0),bytesperline(0),error(false){}
+};
+
+/*
+    refcounted view of a dequeued v4l2 buffer.
+    the kernel buffer goes back through VIDIOC_QBUF when the last copy is dropped.
+    a lease without pool is a plain view, valid only inside IDecoder::sample()
+    unless its source marks it shared (immutable data that outlives the decoder).
+*/
+class FrameLease
+{
+public:
+    unsigned char* data;
+    unsigned long length;
+    int index;
+    FrameInfo info;
+private:
+    LeasePool *pool;
+    bool shared;
+public:
+    FrameLease():data(nullptr),length(0),index(-1),pool(nullptr),shared(false){}
+    FrameLease(unsigned char* d, unsigned long len)
+        :data(d),length(len),index(-1),pool(nullptr),shared(false){}
+    FrameLease(unsigned char* d, unsigned long len, const FrameInfo &info_, bool shared_=false)
+        :data(d),length(len),index(-1),info(info_),pool(nullptr),shared(shared_){}
+    FrameLease(LeasePool *pool_, int index_, unsigned char* d, unsigned long len,
+               const FrameInfo &info_, bool shared_);
+    FrameLease(const FrameLease &r);
+    FrameLease(FrameLease &&r);
+    FrameLease& operator=(const FrameLease &r);
+    FrameLease& operator=(FrameLease &&r);
+    ~FrameLease();
+    void reset();
+    bool empty() const {return data == nullptr;}
+    /* false: the pool is running low, consumers must copy instead of holding the lease */
+    bool retainable() const {return shared;}
+};
+
+class LeasePool
+{
+private:
+    int fd;
+    int count;
+    int reserved;
+    int outstanding;
+    bool streaming;
+    std::unique_ptr<std::atomic<int>[]> refs;
+    std::mutex mutex;
+    std::condition_variable condit;
+protected:
+    void queue(int index);
+public:
+    LeasePool():fd(-1),count(0),reserved(0),outstanding(0),streaming(false){}
+    /* reserved: buffers always left to the kernel */
+    void attach(int fd_, int count_, int reserved_=2);
+    /* wait for consumers to drop their leases, false on timeout. timeoutMs < 0: no timeout */
+    bool detach(int timeoutMs=1000);
+    void setStreaming(bool on);
+    FrameLease acquire(int index, unsigned char* data, const FrameInfo &info);
+    void retain(int index);
+    void release(int index);
+    int leased();
+    /* a consumer still holds buffer index */
+    bool held(int index);
+};
+
+}
+#endif // FRAMELEASE_H
@@ -0,0 +1,213 @@
+#include "framepool.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+Camera::FrameBuffer::FrameBuffer(Camera::FrameBuffer &&r)
+    :data(r.data),capacity(r.capacity),pool(r.pool)
+{
+    r.data = nullptr;
+    r.capacity = 0;
+    r.pool = nullptr;
+}
+
+Camera::FrameBuffer &Camera::FrameBuffer::operator=(Camera::FrameBuffer &&r)
+{
+    if (this == &r) {
+        return *this;
+    }
+    reset();
+    data = r.data;
+    capacity = r.capacity;
+    pool = r.pool;
+    r.data = nullptr;
+    r.capacity = 0;
+    r.pool = nullptr;
+    return *this;
+}
+
+Camera::FrameBuffer::~FrameBuffer()
+{
+    reset();
+}
+
+void Camera::FrameBuffer::reset()
+{
+    if (pool && data) {
+        pool->release(data);
+    }
+    data = nullptr;
+    capacity = 0;
+    pool = nullptr;
+    return;
+}
+
+Camera::FramePool::FramePool()
+    :options(Option_NONE)
+{
+    memset(&statistics, 0, sizeof(statistics));
+}
+
+Camera::FramePool::~FramePool()
+{
+    trim();
+}
+
+Camera::FramePool &Camera::FramePool::instance()
+{
+    /* never destroyed: frames in static objects may be released after main() */
+    static FramePool *pool = new FramePool;
+    return *pool;
+}
+
+unsigned long Camera::FramePool::sizeClass(unsigned long size) const
+{
+    unsigned long unit = page_size;
+    if ((options & Option_HUGEPAGE) && size >= huge_page_size/2) {
+        unit = huge_page_size;
+    }
+    return (size + unit - 1)/unit*unit;
+}
+
+bool Camera::FramePool::map(unsigned long size, Block &block)
+{
+    block.data = nullptr;
+    block.size = size;
+    block.locked = false;
+    block.huge = false;
+    void *mem = MAP_FAILED;
+    if ((options & Option_HUGEPAGE) && size%huge_page_size == 0) {
+        /* reserved hugetlbfs pages, fails when none are configured */
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        block.huge = mem != MAP_FAILED;
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("FramePool: fail to mmap");
+            return false;
+        }
+        if (options & Option_HUGEPAGE) {
+            /* transparent huge pages, best effort */
+            (void) madvise(mem, size, MADV_HUGEPAGE);
+        }
+    }
+    block.data = (unsigned char*)mem;
+    if (options & Option_MLOCK) {
+        if (mlock(mem, size) == 0) {
+            block.locked = true;
+        } else {
+            perror("FramePool: fail to mlock");
+        }
+    }
+    statistics.mapped += size;
+    statistics.blocks++;
+    if (block.locked) {
+        statistics.locked += size;
+    }
+    if (block.huge) {
+        statistics.hugePages += size;
+    }
+    return true;
+}
+
+void Camera::FramePool::unmap(const Block &block)
+{
+    if (block.locked) {
+        munlock(block.data, block.size);
+        statistics.locked -= block.size;
+    }
+    if (block.huge) {
+        statistics.hugePages -= block.size;
+    }
+    if (munmap(block.data, block.size) == -1) {
+        perror("FramePool: fail to munmap");
+    }
+    statistics.mapped -= block.size;
+    statistics.blocks--;
+    return;
+}
+
+void Camera::FramePool::setOptions(int options_)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    options = options_;
+    return;
+}
+
+int Camera::FramePool::getOptions()
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    return options;
+}
+
+void Camera::FramePool::reserve(unsigned long size, int count)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    unsigned long size_ = sizeClass(size);
+    std::vector<Block> &blocks = freeBlocks[size_];
+    for (int i = blocks.size(); i < count; i++) {
+        Block block;
+        if (!map(size_, block)) {
+            break;
+        }
+        blocks.push_back(block);
+    }
+    return;
+}
+
+Camera::FrameBuffer Camera::FramePool::acquire(unsigned long size)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    unsigned long size_ = sizeClass(size);
+    Block block;
+    std::vector<Block> &blocks = freeBlocks[size_];
+    if (!blocks.empty()) {
+        block = blocks.back();
+        blocks.pop_back();
+    } else {
+        statistics.misses++;
+        if (!map(size_, block)) {
+            return FrameBuffer();
+        }
+    }
+    usedBlocks[block.data] = block;
+    statistics.inUse += block.size;
+    return FrameBuffer(this, block.data, block.size);
+}
+
+void Camera::FramePool::release(unsigned char *data)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    std::map<unsigned char*, Block>::iterator it = usedBlocks.find(data);
+    if (it == usedBlocks.end()) {
+        fprintf(stderr, "FramePool: release of unknown block %p\n", (void*)data);
+        return;
+    }
+    Block block = it->second;
+    usedBlocks.erase(it);
+    statistics.inUse -= block.size;
+    freeBlocks[block.size].push_back(block);
+    return;
+}
+
+void Camera::FramePool::trim()
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    for (std::map<unsigned long, std::vector<Block> >::iterator it = freeBlocks.begin();
+         it != freeBlocks.end(); it++) {
+        for (std::size_t i = 0; i < it->second.size(); i++) {
+            unmap(it->second[i]);
+        }
+    }
+    freeBlocks.clear();
+    return;
+}
+
+Camera::FramePool::Statistics Camera::FramePool::getStatistics()
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    return statistics;
+}
@@ -0,0 +1,97 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+#include <mutex>
+#include <map>
+#include <vector>
+
+namespace Camera {
+
+class FramePool;
+
+/* block of the FramePool, goes back to the pool when the last owner drops it */
+class FrameBuffer
+{
+public:
+    unsigned char* data;
+    unsigned long capacity;
+private:
+    FramePool *pool;
+public:
+    FrameBuffer():data(nullptr),capacity(0),pool(nullptr){}
+    FrameBuffer(FramePool *pool_, unsigned char* d, unsigned long c)
+        :data(d),capacity(c),pool(pool_){}
+    FrameBuffer(const FrameBuffer &r) = delete;
+    FrameBuffer& operator=(const FrameBuffer &r) = delete;
+    FrameBuffer(FrameBuffer &&r);
+    FrameBuffer& operator=(FrameBuffer &&r);
+    ~FrameBuffer();
+    void reset();
+    bool empty() const {return data == nullptr;}
+};
+
+/*
+    process wide frame memory shared by every decoder.
+    blocks are page aligned mmaps (so 64-byte aligned for SIMD) in size classes of whole pages,
+    faulted in when mapped and kept mapped when released: in steady state
+    a frame is neither allocated nor page faulted. memory is bounded by the blocks
+    in use at the peak, trim() gives back the free ones. devices and replays
+    trim after every format change and when their decoder goes, so the size
+    classes of a previous resolution do not stay mapped.
+*/
+class FramePool
+{
+public:
+    constexpr static unsigned long alignment = 64;
+    constexpr static unsigned long page_size = 4096;
+    constexpr static unsigned long huge_page_size = 2<<20;
+    enum Option {
+        Option_NONE = 0,
+        Option_HUGEPAGE = 1,    /* MAP_HUGETLB, else madvise(MADV_HUGEPAGE) */
+        Option_MLOCK = 2        /* pin blocks in RAM, needs RLIMIT_MEMLOCK */
+    };
+    struct Statistics {
+        unsigned long mapped;   /* bytes */
+        unsigned long inUse;    /* bytes */
+        unsigned long locked;   /* bytes */
+        unsigned long hugePages;/* bytes backed by MAP_HUGETLB */
+        unsigned long blocks;
+        unsigned long misses;   /* acquire() that had to map */
+    };
+protected:
+    struct Block {
+        unsigned char* data;
+        unsigned long size;
+        bool locked;
+        bool huge;
+    };
+    int options;
+    /* size class -> free blocks */
+    std::map<unsigned long, std::vector<Block> > freeBlocks;
+    /* blocks handed out */
+    std::map<unsigned char*, Block> usedBlocks;
+    Statistics statistics;
+    std::mutex mutex;
+protected:
+    FramePool();
+    unsigned long sizeClass(unsigned long size) const;
+    bool map(unsigned long size, Block &block);
+    void unmap(const Block &block);
+public:
+    ~FramePool();
+    FramePool(const FramePool &r) = delete;
+    FramePool& operator=(const FramePool &r) = delete;
+    static FramePool& instance();
+    /* Option flags, apply to blocks mapped afterwards */
+    void setOptions(int options_);
+    int getOptions();
+    /* map count blocks of size ahead of acquire(), e.g. once the format is negotiated */
+    void reserve(unsigned long size, int count);
+    FrameBuffer acquire(unsigned long size);
+    void release(unsigned char* data);
+    /* unmap every free block */
+    void trim();
+    Statistics getStatistics();
+};
+
+}
+#endif // FRAMEPOOL_H
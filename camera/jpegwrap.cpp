@@ -23,7 +23,6 @@ int Jpeg::encode(uint8_t*& jpeg, std::size_t &totalsize,
     jpeg_create_compress(&cinfo);
     unsigned long size = 0;
     jpeg_mem_dest(&cinfo, &jpeg, &size);
-    totalsize = size;
     cinfo.image_width = w;
     cinfo.image_height = h;
     cinfo.input_components = 3;
@@ -36,62 +35,368 @@ int Jpeg::encode(uint8_t*& jpeg, std::size_t &totalsize,
         (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
     jpeg_finish_compress(&cinfo);
+    /* size is only known once the compressor has flushed */
+    totalsize = size;
     jpeg_destroy_compress(&cinfo);
     return 0;
 }
 
-int Jpeg::decode(uint8_t* &rgb, int &w, int &h,
-                            uint8_t *jpeg, std::size_t totalsize, int scale, int align)
+Jpeg::Decompressor::Decompressor()
 {
-    if (jpeg == nullptr || totalsize == 0) {
-        return -1;
-    }
-    struct jpeg_decompress_struct cinfo;
-    Jpeg::Error jpegError;
     cinfo.err = jpeg_std_error(&jpegError.pub);
     jpegError.pub.error_exit = errorNotify;
+    jpeg_create_decompress(&cinfo);
+}
+
+Jpeg::Decompressor::~Decompressor()
+{
+    jpeg_destroy_decompress(&cinfo);
+}
+
+int Jpeg::Decompressor::decompress(uint8_t *dst, int &w, int &h,
+                                   uint8_t *jpeg, std::size_t totalsize, int scale, int align,
+                                   std::size_t capacity, J_COLOR_SPACE colorSpace)
+{
+    if (dst == nullptr || jpeg == nullptr || totalsize == 0) {
+        return -1;
+    }
     if (setjmp(jpegError.setjmp_buffer)) {
-        jpeg_destroy_decompress(&cinfo);
+        /* keep the object and its permanent pool for the next frame */
+        jpeg_abort_decompress(&cinfo);
         return -2;
     }
-    jpeg_create_decompress(&cinfo);
     jpeg_mem_src(&cinfo, jpeg, totalsize);
     jpeg_read_header(&cinfo, TRUE);
     cinfo.scale_num = 1;
     cinfo.scale_denom = scale;
+    /* grayscale drops chroma before the IDCT */
+    cinfo.out_color_space = colorSpace;
     if (!jpeg_start_decompress(&cinfo)) {
+        jpeg_abort_decompress(&cinfo);
         return -3;
     }
-    int rowstride = cinfo.output_width * cinfo.output_components;
+    std::size_t rowstride = cinfo.output_width * cinfo.output_components;
     if (align == ALIGN_4) {
         rowstride = Jpeg::align4(cinfo.output_width, cinfo.output_components);
     }
+    if (capacity != 0 && rowstride*cinfo.output_height > capacity) {
+        fprintf(stderr, "Jpeg: %ux%u does not fit output buffer\n",
+                cinfo.output_width, cinfo.output_height);
+        jpeg_abort_decompress(&cinfo);
+        return -4;
+    }
     w = cinfo.output_width;
     h = cinfo.output_height;
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, rowstride, 1);
-    if (buffer == nullptr) {
-        jpeg_finish_decompress(&cinfo);
-        jpeg_destroy_decompress(&cinfo);
+    JSAMPROW rows[batch_rows];
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JDIMENSION n = cinfo.output_height - cinfo.output_scanline;
+        if (n > batch_rows) {
+            n = batch_rows;
+        }
+        for (JDIMENSION i = 0; i < n; i++) {
+            rows[i] = dst + (cinfo.output_scanline + i)*rowstride;
+        }
+        (void) jpeg_read_scanlines(&cinfo, rows, n);
+    }
+    jpeg_finish_decompress(&cinfo);
+    return 0;
+}
+
+int Jpeg::Decompressor::decode(uint8_t *rgb, int &w, int &h,
+                               uint8_t *jpeg, std::size_t totalsize, int scale, int align,
+                               std::size_t capacity)
+{
+    return decompress(rgb, w, h, jpeg, totalsize, scale, align, capacity, JCS_RGB);
+}
+
+int Jpeg::Decompressor::decodeGray(uint8_t *gray, int &w, int &h,
+                                   uint8_t *jpeg, std::size_t totalsize, int scale, int align,
+                                   std::size_t capacity)
+{
+    return decompress(gray, w, h, jpeg, totalsize, scale, align, capacity, JCS_GRAYSCALE);
+}
+
+#if JPEG_LIB_VERSION >= 70
+#define JPEG_DCT_H_SCALED_SIZE(comp) (comp).DCT_h_scaled_size
+#define JPEG_DCT_V_SCALED_SIZE(comp) (comp).DCT_v_scaled_size
+#define JPEG_MIN_DCT_H_SCALED_SIZE(cinfo) (cinfo).min_DCT_h_scaled_size
+#else
+#define JPEG_DCT_H_SCALED_SIZE(comp) (comp).DCT_scaled_size
+#define JPEG_DCT_V_SCALED_SIZE(comp) (comp).DCT_scaled_size
+#define JPEG_MIN_DCT_H_SCALED_SIZE(cinfo) (cinfo).min_DCT_scaled_size
+#endif
+
+int Jpeg::Decompressor::decodeRegion(uint8_t *dst, int stride, int x, int y, int w, int h,
+                                     uint8_t *jpeg, std::size_t totalsize, int scale, int channels)
+{
+    if (jpeg == nullptr || totalsize == 0 || dst == nullptr || w <= 0 || h <= 0) {
+        return -1;
+    }
+    if (setjmp(jpegError.setjmp_buffer)) {
+        jpeg_abort_decompress(&cinfo);
+        return -2;
+    }
+    jpeg_mem_src(&cinfo, jpeg, totalsize);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    if (!jpeg_start_decompress(&cinfo)) {
+        jpeg_abort_decompress(&cinfo);
+        return -3;
+    }
+    if (x < 0 || y < 0 || x + w > int(cinfo.output_width) || y + h > int(cinfo.output_height)) {
+        jpeg_abort_decompress(&cinfo);
+        return -6;
+    }
+    /*
+        libjpeg moves left down to an iMCU column, the right end is rounded up here.
+        one pixel more on each side keeps fancy upsampling off the replicated edge.
+    */
+    JDIMENSION unit = cinfo.max_h_samp_factor*JPEG_MIN_DCT_H_SCALED_SIZE(cinfo);
+    JDIMENSION left = x > 0 ? x - 1 : 0;
+    JDIMENSION right = (x + w + unit)/unit*unit;
+    if (right > cinfo.output_width) {
+        right = cinfo.output_width;
+    }
+    JDIMENSION cropWidth = right - left;
+    if (cropWidth < cinfo.output_width) {
+        jpeg_crop_scanline(&cinfo, &left, &cropWidth);
+    }
+    /* rows above are entropy decoded only, no IDCT or color conversion */
+    if (y > 0 && jpeg_skip_scanlines(&cinfo, y) != JDIMENSION(y)) {
+        jpeg_abort_decompress(&cinfo);
         return -4;
     }
-    unsigned long pos = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        /* jpeg_read_scanlines expects an array of pointers to scanlines.
-         * Here the array is only one element long, but you could ask for
-         * more than one scanline at a time if that's more convenient.
-         */
-        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-        /* Assume put_scanline_someplace wants a pointer and sample count. */
+    std::size_t rowStride = std::size_t(cropWidth)*channels;
+    if (scanlines.size() < rowStride*batch_rows) {
+        scanlines.resize(rowStride*batch_rows);
+    }
+    JSAMPROW rows[batch_rows];
+    for (int i = 0; i < batch_rows; i++) {
+        rows[i] = scanlines.data() + i*rowStride;
+    }
+    std::size_t offset = std::size_t(x - left)*channels;
+    int end = y + h;
+    while (int(cinfo.output_scanline) < end) {
+        int row = cinfo.output_scanline - y;
+        JDIMENSION n = end - cinfo.output_scanline;
+        if (n > batch_rows) {
+            n = batch_rows;
+        }
+        int count = jpeg_read_scanlines(&cinfo, rows, n);
+        if (count == 0) {
+            jpeg_abort_decompress(&cinfo);
+            return -4;
+        }
+        for (int i = 0; i < count; i++) {
+            memcpy(dst + std::size_t(row + i)*stride, rows[i] + offset, std::size_t(w)*channels);
+        }
+    }
+    /* rows below the region are never decoded */
+    jpeg_abort_decompress(&cinfo);
+    return 0;
+}
 
-        //put_scanline_someplace(buffer[0], row_stride);
-        memcpy(rgb + pos, buffer[0], rowstride);
-        pos += rowstride;
+int Jpeg::Decompressor::prepareRaw(Planar &yuv, int &linesY, int &linesUV,
+                                    uint8_t *jpeg, std::size_t totalsize, int scale)
+{
+    jpeg_mem_src(&cinfo, jpeg, totalsize);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_component_info *comp = cinfo.comp_info;
+    if (cinfo.num_components != 3 || cinfo.jpeg_color_space != JCS_YCbCr ||
+            comp[0].h_samp_factor != cinfo.max_h_samp_factor ||
+            comp[0].v_samp_factor != cinfo.max_v_samp_factor ||
+            comp[1].h_samp_factor != comp[2].h_samp_factor ||
+            comp[1].v_samp_factor != comp[2].v_samp_factor) {
+        jpeg_abort_decompress(&cinfo);
+        return -5;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.raw_data_out = TRUE;
+    jpeg_calc_output_dimensions(&cinfo);
+    /* when scaling, libjpeg may enlarge chroma in the IDCT, the planes follow it */
+    linesY = comp[0].v_samp_factor*JPEG_DCT_V_SCALED_SIZE(comp[0]);
+    linesUV = comp[1].v_samp_factor*JPEG_DCT_V_SCALED_SIZE(comp[1]);
+    int unitY = comp[0].h_samp_factor*JPEG_DCT_H_SCALED_SIZE(comp[0]);
+    int unitUV = comp[1].h_samp_factor*JPEG_DCT_H_SCALED_SIZE(comp[1]);
+    if (linesY > 16 || linesUV > 16 || (linesY != linesUV && linesY != linesUV*2) ||
+            (unitY != unitUV && unitY != unitUV*2) || (unitY == unitUV && linesY != linesUV)) {
+        jpeg_abort_decompress(&cinfo);
+        return -5;
+    }
+    if (unitY == unitUV) {
+        yuv.subsample = SUBSAMPLE_444;
+    } else if (linesY == linesUV) {
+        yuv.subsample = SUBSAMPLE_422;
+    } else {
+        yuv.subsample = SUBSAMPLE_420;
+    }
+    yuv.width = cinfo.output_width;
+    yuv.height = cinfo.output_height;
+    yuv.strideY = comp[0].width_in_blocks*JPEG_DCT_H_SCALED_SIZE(comp[0]);
+    yuv.strideUV = comp[1].width_in_blocks*JPEG_DCT_H_SCALED_SIZE(comp[1]);
+    return 0;
+}
+
+int Jpeg::Decompressor::readRaw(const Planar &yuv, int linesY, int linesUV)
+{
+    JSAMPROW rowY[16];
+    JSAMPROW rowU[16];
+    JSAMPROW rowV[16];
+    JSAMPARRAY data[3] = {rowY, rowU, rowV};
+    for (int row = 0; cinfo.output_scanline < cinfo.output_height; row++) {
+        for (int i = 0; i < linesY; i++) {
+            rowY[i] = yuv.y + std::size_t(row*linesY + i)*yuv.strideY;
+        }
+        for (int i = 0; i < linesUV; i++) {
+            rowU[i] = yuv.u + std::size_t(row*linesUV + i)*yuv.strideUV;
+            rowV[i] = yuv.v + std::size_t(row*linesUV + i)*yuv.strideUV;
+        }
+        if (jpeg_read_raw_data(&cinfo, data, linesY) == 0) {
+            jpeg_abort_decompress(&cinfo);
+            return -4;
+        }
     }
     jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
     return 0;
 }
 
+int Jpeg::Decompressor::layoutYUV(Planar &yuv, std::vector<uint8_t> &buffer,
+                                   uint8_t *jpeg, std::size_t totalsize, int scale)
+{
+    if (jpeg == nullptr || totalsize == 0) {
+        return -1;
+    }
+    if (setjmp(jpegError.setjmp_buffer)) {
+        jpeg_abort_decompress(&cinfo);
+        return -2;
+    }
+    int linesY = 0;
+    int linesUV = 0;
+    int ret = prepareRaw(yuv, linesY, linesUV, jpeg, totalsize, scale);
+    if (ret != 0) {
+        return ret;
+    }
+    /* libjpeg writes whole blocks and iMCU rows, planes are padded to them */
+    int rows = cinfo.total_iMCU_rows;
+    jpeg_abort_decompress(&cinfo);
+    std::size_t sizeY = std::size_t(yuv.strideY)*rows*linesY;
+    std::size_t sizeUV = std::size_t(yuv.strideUV)*rows*linesUV;
+    if (buffer.size() < sizeY + sizeUV*2) {
+        buffer.resize(sizeY + sizeUV*2);
+    }
+    yuv.y = buffer.data();
+    yuv.u = yuv.y + sizeY;
+    yuv.v = yuv.u + sizeUV;
+    return 0;
+}
+
+int Jpeg::Decompressor::decodeYUV(Planar &yuv, uint8_t *jpeg, std::size_t totalsize, int scale)
+{
+    int ret = layoutYUV(yuv, planes, jpeg, totalsize, scale);
+    if (ret != 0) {
+        return ret;
+    }
+    return decodeYUVTo(yuv, jpeg, totalsize, scale);
+}
+
+int Jpeg::Decompressor::decodeYUVTo(const Planar &target, uint8_t *jpeg, std::size_t totalsize, int scale)
+{
+    if (jpeg == nullptr || totalsize == 0 || target.y == nullptr) {
+        return -1;
+    }
+    if (setjmp(jpegError.setjmp_buffer)) {
+        jpeg_abort_decompress(&cinfo);
+        return -2;
+    }
+    Planar yuv;
+    int linesY = 0;
+    int linesUV = 0;
+    int ret = prepareRaw(yuv, linesY, linesUV, jpeg, totalsize, scale);
+    if (ret != 0) {
+        return ret;
+    }
+    if (yuv.subsample != target.subsample ||
+            yuv.strideY > target.strideY || yuv.strideUV > target.strideUV) {
+        jpeg_abort_decompress(&cinfo);
+        return -6;
+    }
+    if (!jpeg_start_decompress(&cinfo)) {
+        jpeg_abort_decompress(&cinfo);
+        return -3;
+    }
+    return readRaw(target, linesY, linesUV);
+}
+
+int Jpeg::decode(uint8_t* &rgb, int &w, int &h,
+                            uint8_t *jpeg, std::size_t totalsize, int scale, int align)
+{
+    Decompressor decompressor;
+    return decompressor.decode(rgb, w, h, jpeg, totalsize, scale, align);
+}
+
+int Jpeg::validate(const uint8_t *jpeg, std::size_t totalsize, int w, int h)
+{
+    if (jpeg == nullptr || totalsize < 4) {
+        return CHECK_TRUNCATED;
+    }
+    if (jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return CHECK_SOI;
+    }
+    /* some cameras pad the payload after EOI */
+    std::size_t end = totalsize;
+    while (end > 4 && jpeg[end - 1] == 0x00) {
+        end--;
+    }
+    if (jpeg[end - 2] != 0xFF || jpeg[end - 1] != 0xD9) {
+        return CHECK_EOI;
+    }
+    bool frameHeader = false;
+    std::size_t pos = 2;
+    while (pos + 4 <= end) {
+        if (jpeg[pos] != 0xFF) {
+            return CHECK_SEGMENT;
+        }
+        uint8_t marker = jpeg[pos + 1];
+        if (marker == 0xFF) {
+            /* fill byte */
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || marker == 0xD8 || marker == 0xD9 || (marker >= 0xD0 && marker <= 0xD7)) {
+            /* no standalone marker belongs before the scan */
+            return CHECK_SEGMENT;
+        }
+        std::size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+        if (length < 2 || pos + 2 + length > end - 2) {
+            return CHECK_SEGMENT;
+        }
+        if (marker >= 0xC0 && marker <= 0xCF &&
+                marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            /* SOFn: precision, height, width */
+            if (length < 8) {
+                return CHECK_SEGMENT;
+            }
+            int height = (jpeg[pos + 5] << 8) | jpeg[pos + 6];
+            int width = (jpeg[pos + 7] << 8) | jpeg[pos + 8];
+            if (w > 0 && h > 0 && (width != w || height != h)) {
+                return CHECK_DIMENSION;
+            }
+            frameHeader = true;
+        } else if (marker == 0xDA) {
+            /* entropy coded data lies between the scan header and EOI */
+            if (!frameHeader || pos + 2 + length >= end - 2) {
+                return CHECK_SEGMENT;
+            }
+            return CHECK_OK;
+        }
+        pos += 2 + length;
+    }
+    return CHECK_TRUNCATED;
+}
+
 int Jpeg::load(const char *filename, std::shared_ptr<uint8_t[]> &img, int &h, int &w, int &c)
 {
     /* This struct contains the JPEG decompression parameters and pointers to
@@ -7,6 +7,7 @@
 #include <jpeglib.h>
 #include <setjmp.h>
 #include <memory>
+#include <vector>
 
 /*
     wrapper of libjpeg examples
@@ -33,6 +34,77 @@ public:
         SCALE_D4 = 4,
         SCALE_D8 = 8
     };
+    enum Check {
+        CHECK_OK = 0,
+        CHECK_TRUNCATED,
+        CHECK_SOI,
+        CHECK_EOI,
+        CHECK_SEGMENT,
+        CHECK_DIMENSION
+    };
+    enum Subsample {
+        SUBSAMPLE_420 = 0,
+        SUBSAMPLE_422,
+        SUBSAMPLE_444
+    };
+    /* planes of a raw decode, full range YCbCr, valid until the next decode */
+    struct Planar {
+        int width;
+        int height;
+        int subsample;
+        uint8_t* y;
+        uint8_t* u;
+        uint8_t* v;
+        int strideY;
+        int strideUV;
+    };
+    /*
+        decompressor kept alive across frames, one per decoding thread.
+        scanlines are read in batches straight into the caller's rows.
+    */
+    class Decompressor
+    {
+    public:
+        constexpr static int batch_rows = 16;
+    protected:
+        struct jpeg_decompress_struct cinfo;
+        Error jpegError;
+        std::vector<uint8_t> planes;
+        std::vector<uint8_t> scanlines;
+    protected:
+        int decompress(uint8_t* dst, int &w, int &h,
+                       uint8_t *jpeg, std::size_t totalsize, int scale, int align,
+                       std::size_t capacity, J_COLOR_SPACE colorSpace);
+        int prepareRaw(Planar &yuv, int &linesY, int &linesUV,
+                       uint8_t *jpeg, std::size_t totalsize, int scale);
+        int readRaw(const Planar &yuv, int linesY, int linesUV);
+    public:
+        Decompressor();
+        ~Decompressor();
+        Decompressor(const Decompressor &r) = delete;
+        Decompressor& operator=(const Decompressor &r) = delete;
+        /* capacity: size of rgb in bytes, 0: unchecked */
+        int decode(uint8_t* rgb, int &w, int &h,
+                   uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1, int align=ALIGN_4,
+                   std::size_t capacity=0);
+        /* luma only, chroma is neither decoded nor upsampled */
+        int decodeGray(uint8_t* gray, int &w, int &h,
+                       uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1, int align=ALIGN_4,
+                       std::size_t capacity=0);
+        /*
+            x,y,w*h of the scaled image into dst rows of stride bytes, R,G,B or luma (channels 1).
+            rows outside are skipped, columns outside are cropped to iMCU precision.
+        */
+        int decodeRegion(uint8_t* dst, int stride, int x, int y, int w, int h,
+                         uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1, int channels = 3);
+        /* skip libjpeg's color conversion, -5: sampling has no libyuv planar layout */
+        int decodeYUV(Planar &yuv, uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1);
+        /* header only: planes for a full raw decode placed in buffer, nothing decoded */
+        int layoutYUV(Planar &yuv, std::vector<uint8_t> &buffer,
+                      uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1);
+        /* raw decode into planes of the caller, -6: layout does not fit them */
+        int decodeYUVTo(const Planar &target, uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1);
+    };
 public:
     static void errorNotify(j_common_ptr cinfo);
     static inline int align4(int width, int channel) {return (width*channel+3)/4*4;}
@@ -40,6 +112,8 @@ public:
                uint8_t* img, int w, int h, int rowstride, int quality=90);
     static int decode(uint8_t* &rgb, int &w, int &h,
                uint8_t *jpeg, std::size_t totalsize, int scale = SCALE_D1, int align=ALIGN_4);
+    /* marker walk up to SOS plus the EOI at the end, the entropy coded data is not read */
+    static int validate(const uint8_t *jpeg, std::size_t totalsize, int w=0, int h=0);
     static int load(const char* filename, std::shared_ptr<uint8_t[]>& img, int &h, int &w, int &c);
     static int save(const char* filename, uint8_t* img, int h, int w, int c, int quality=90);
 };
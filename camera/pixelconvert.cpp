@@ -0,0 +1,312 @@
+#include "pixelconvert.h"
+
+static inline int chromaWidth(int subsample, int w)
+{
+    return subsample == Jpeg::SUBSAMPLE_444 ? w : (w + 1)/2;
+}
+
+static inline int chromaHeight(int subsample, int h)
+{
+    return subsample == Jpeg::SUBSAMPLE_420 ? (h + 1)/2 : h;
+}
+
+/* libyuv's RGB24 is B,G,R in memory, swapping U and V gives R,G,B */
+static void planarToRGB24(const Jpeg::Planar &yuv, bool swapUV,
+                          const libyuv::YuvConstants *constants, unsigned char* dst, int stride)
+{
+    const unsigned char* u = swapUV ? yuv.v : yuv.u;
+    const unsigned char* v = swapUV ? yuv.u : yuv.v;
+    if (yuv.subsample == Jpeg::SUBSAMPLE_420) {
+        libyuv::I420ToRGB24Matrix(yuv.y, yuv.strideY, u, yuv.strideUV, v, yuv.strideUV,
+                                  dst, stride, constants, yuv.width, yuv.height);
+    } else if (yuv.subsample == Jpeg::SUBSAMPLE_422) {
+        libyuv::I422ToRGB24Matrix(yuv.y, yuv.strideY, u, yuv.strideUV, v, yuv.strideUV,
+                                  dst, stride, constants, yuv.width, yuv.height);
+    } else {
+        libyuv::I444ToRGB24Matrix(yuv.y, yuv.strideY, u, yuv.strideUV, v, yuv.strideUV,
+                                  dst, stride, constants, yuv.width, yuv.height);
+    }
+    return;
+}
+
+static void planarToARGB(const Jpeg::Planar &yuv,
+                         const libyuv::YuvConstants *constants, unsigned char* dst, int stride)
+{
+    if (yuv.subsample == Jpeg::SUBSAMPLE_420) {
+        libyuv::I420ToARGBMatrix(yuv.y, yuv.strideY, yuv.u, yuv.strideUV, yuv.v, yuv.strideUV,
+                                 dst, stride, constants, yuv.width, yuv.height);
+    } else if (yuv.subsample == Jpeg::SUBSAMPLE_422) {
+        libyuv::I422ToARGBMatrix(yuv.y, yuv.strideY, yuv.u, yuv.strideUV, yuv.v, yuv.strideUV,
+                                 dst, stride, constants, yuv.width, yuv.height);
+    } else {
+        libyuv::I444ToARGBMatrix(yuv.y, yuv.strideY, yuv.u, yuv.strideUV, yuv.v, yuv.strideUV,
+                                 dst, stride, constants, yuv.width, yuv.height);
+    }
+    return;
+}
+
+int Camera::PixelConvert::stride(int format, int w)
+{
+    switch (format) {
+    case Output_BGRA:
+        return w*4;
+    case Output_GRAY8:
+        return Jpeg::align4(w, 1);
+    case Output_NV12:
+    case Output_I420:
+        return w;
+    default:
+        return Jpeg::align4(w, 3);
+    }
+}
+
+unsigned long Camera::PixelConvert::length(int format, int w, int h)
+{
+    if (format == Output_NV12 || format == Output_I420) {
+        return (unsigned long)w*h + 2ul*((w + 1)/2)*((h + 1)/2);
+    }
+    return (unsigned long)stride(format, w)*h;
+}
+
+int Camera::PixelConvert::channels(int format)
+{
+    switch (format) {
+    case Output_BGRA:
+        return 4;
+    case Output_GRAY8:
+    case Output_NV12:
+    case Output_I420:
+        return 1;
+    default:
+        return 3;
+    }
+}
+
+void Camera::PixelConvert::fromPlanar(const Jpeg::Planar &yuv, bool fullRange, int format, unsigned char *dst,
+                                      std::vector<unsigned char> *buffer)
+{
+    int w = yuv.width;
+    int h = yuv.height;
+    int cw = (w + 1)/2;
+    int ch = (h + 1)/2;
+    const libyuv::YuvConstants *yuvConstants = fullRange ? &libyuv::kYuvJPEGConstants : &libyuv::kYuvI601Constants;
+    const libyuv::YuvConstants *yvuConstants = fullRange ? &libyuv::kYvuJPEGConstants : &libyuv::kYvuI601Constants;
+    switch (format) {
+    case Output_BGR24:
+        planarToRGB24(yuv, false, yuvConstants, dst, stride(format, w));
+        break;
+    case Output_BGRA:
+        planarToARGB(yuv, yuvConstants, dst, w*4);
+        break;
+    case Output_GRAY8:
+        libyuv::CopyPlane(yuv.y, yuv.strideY, dst, stride(format, w), w, h);
+        break;
+    case Output_I420: {
+        unsigned char* u = dst + w*h;
+        unsigned char* v = u + cw*ch;
+        libyuv::CopyPlane(yuv.y, yuv.strideY, dst, w, w, h);
+        if (yuv.subsample == Jpeg::SUBSAMPLE_420) {
+            libyuv::CopyPlane(yuv.u, yuv.strideUV, u, cw, cw, ch);
+            libyuv::CopyPlane(yuv.v, yuv.strideUV, v, cw, cw, ch);
+        } else {
+            int sw = chromaWidth(yuv.subsample, w);
+            int sh = chromaHeight(yuv.subsample, h);
+            libyuv::ScalePlane(yuv.u, yuv.strideUV, sw, sh, u, cw, cw, ch, libyuv::kFilterBox);
+            libyuv::ScalePlane(yuv.v, yuv.strideUV, sw, sh, v, cw, cw, ch, libyuv::kFilterBox);
+        }
+        break;
+    }
+    case Output_NV12: {
+        unsigned char* uv = dst + w*h;
+        if (yuv.subsample == Jpeg::SUBSAMPLE_420) {
+            libyuv::I420ToNV12(yuv.y, yuv.strideY, yuv.u, yuv.strideUV, yuv.v, yuv.strideUV,
+                               dst, w, uv, cw*2, w, h);
+        } else {
+            std::vector<unsigned char> local;
+            std::vector<unsigned char> &chroma = buffer ? *buffer : local;
+            if (chroma.size() < std::size_t(cw*ch*2)) {
+                chroma.resize(cw*ch*2);
+            }
+            int sw = chromaWidth(yuv.subsample, w);
+            int sh = chromaHeight(yuv.subsample, h);
+            libyuv::CopyPlane(yuv.y, yuv.strideY, dst, w, w, h);
+            libyuv::ScalePlane(yuv.u, yuv.strideUV, sw, sh, chroma.data(), cw, cw, ch, libyuv::kFilterBox);
+            libyuv::ScalePlane(yuv.v, yuv.strideUV, sw, sh, chroma.data() + cw*ch, cw, cw, ch, libyuv::kFilterBox);
+            libyuv::MergeUVPlane(chroma.data(), cw, chroma.data() + cw*ch, cw, uv, cw*2, cw, ch);
+        }
+        break;
+    }
+    default:
+        planarToRGB24(yuv, true, yvuConstants, dst, stride(Output_RGB24, w));
+        break;
+    }
+    return;
+}
+
+void Camera::PixelConvert::scalePlanar(const Jpeg::Planar &src, Jpeg::Planar &dst,
+                                       std::vector<unsigned char> &buffer, int w, int h)
+{
+    dst.width = w;
+    dst.height = h;
+    dst.subsample = src.subsample;
+    dst.strideY = w;
+    dst.strideUV = chromaWidth(src.subsample, w);
+    std::size_t sizeY = std::size_t(dst.strideY)*h;
+    std::size_t sizeUV = std::size_t(dst.strideUV)*chromaHeight(src.subsample, h);
+    if (buffer.size() < sizeY + sizeUV*2) {
+        buffer.resize(sizeY + sizeUV*2);
+    }
+    dst.y = buffer.data();
+    dst.u = dst.y + sizeY;
+    dst.v = dst.u + sizeUV;
+    if (src.subsample == Jpeg::SUBSAMPLE_420) {
+        libyuv::I420Scale(src.y, src.strideY, src.u, src.strideUV, src.v, src.strideUV,
+                          src.width, src.height,
+                          dst.y, dst.strideY, dst.u, dst.strideUV, dst.v, dst.strideUV,
+                          w, h, libyuv::kFilterBilinear);
+    } else if (src.subsample == Jpeg::SUBSAMPLE_422) {
+        libyuv::I422Scale(src.y, src.strideY, src.u, src.strideUV, src.v, src.strideUV,
+                          src.width, src.height,
+                          dst.y, dst.strideY, dst.u, dst.strideUV, dst.v, dst.strideUV,
+                          w, h, libyuv::kFilterBilinear);
+    } else {
+        libyuv::I444Scale(src.y, src.strideY, src.u, src.strideUV, src.v, src.strideUV,
+                          src.width, src.height,
+                          dst.y, dst.strideY, dst.u, dst.strideUV, dst.v, dst.strideUV,
+                          w, h, libyuv::kFilterBilinear);
+    }
+    return;
+}
+
+void Camera::PixelConvert::scale(int format, const unsigned char *src, int srcWidth, int srcHeight, int srcStride,
+                                 unsigned char *dst, int dstWidth, int dstHeight, int dstStride,
+                                 libyuv::FilterMode filter)
+{
+    int srcCw = (srcWidth + 1)/2;
+    int srcCh = (srcHeight + 1)/2;
+    int dstCw = (dstWidth + 1)/2;
+    int dstCh = (dstHeight + 1)/2;
+    const unsigned char* srcUV = src + srcStride*srcHeight;
+    unsigned char* dstUV = dst + dstStride*dstHeight;
+    switch (format) {
+    case Output_BGRA:
+        libyuv::ARGBScale(src, srcStride, srcWidth, srcHeight,
+                          dst, dstStride, dstWidth, dstHeight, filter);
+        break;
+    case Output_GRAY8:
+        libyuv::ScalePlane(src, srcStride, srcWidth, srcHeight,
+                           dst, dstStride, dstWidth, dstHeight, filter);
+        break;
+    case Output_NV12:
+        libyuv::NV12Scale(src, srcStride, srcUV, srcCw*2, srcWidth, srcHeight,
+                          dst, dstStride, dstUV, dstCw*2, dstWidth, dstHeight, filter);
+        break;
+    case Output_I420:
+        libyuv::I420Scale(src, srcStride, srcUV, srcCw, srcUV + srcCw*srcCh, srcCw, srcWidth, srcHeight,
+                          dst, dstStride, dstUV, dstCw, dstUV + dstCw*dstCh, dstCw, dstWidth, dstHeight,
+                          filter);
+        break;
+    default:
+        libyuv::RGBScale(src, srcStride, srcWidth, srcHeight,
+                         dst, dstStride, dstWidth, dstHeight, filter);
+        break;
+    }
+    return;
+}
+
+void Camera::PixelConvert::toPlanar(const unsigned char *yuy2, int w, int h, Jpeg::Planar &yuv,
+                                    std::vector<unsigned char> &buffer, int srcStride)
+{
+    int cw = (w + 1)/2;
+    if (srcStride == 0) {
+        srcStride = cw*4;
+    }
+    std::size_t sizeY = std::size_t(w)*h;
+    std::size_t sizeUV = std::size_t(cw)*h;
+    if (buffer.size() < sizeY + sizeUV*2) {
+        buffer.resize(sizeY + sizeUV*2);
+    }
+    yuv.width = w;
+    yuv.height = h;
+    yuv.subsample = Jpeg::SUBSAMPLE_422;
+    yuv.strideY = w;
+    yuv.strideUV = cw;
+    yuv.y = buffer.data();
+    yuv.u = yuv.y + sizeY;
+    yuv.v = yuv.u + sizeUV;
+    libyuv::YUY2ToI422(yuy2, srcStride, yuv.y, yuv.strideY, yuv.u, yuv.strideUV, yuv.v, yuv.strideUV, w, h);
+    return;
+}
+
+void Camera::PixelConvert::fromYUY2(const unsigned char *yuy2, int w, int h, int format, unsigned char *dst,
+                                    std::vector<unsigned char> &buffer, int srcStride)
+{
+    int cw = (w + 1)/2;
+    int ch = (h + 1)/2;
+    if (srcStride == 0) {
+        srcStride = cw*4;
+    }
+    switch (format) {
+    case Output_BGRA:
+        libyuv::YUY2ToARGB(yuy2, srcStride, dst, w*4, w, h);
+        break;
+    case Output_GRAY8:
+        libyuv::YUY2ToY(yuy2, srcStride, dst, stride(format, w), w, h);
+        break;
+    case Output_I420:
+        libyuv::YUY2ToI420(yuy2, srcStride, dst, w, dst + w*h, cw, dst + w*h + cw*ch, cw, w, h);
+        break;
+    case Output_NV12:
+        libyuv::YUY2ToNV12(yuy2, srcStride, dst, w, dst + w*h, cw*2, w, h);
+        break;
+    default: {
+        /* no packed kernel for 24 bit output, go through I422 */
+        Jpeg::Planar yuv;
+        toPlanar(yuy2, w, h, yuv, buffer, srcStride);
+        fromPlanar(yuv, false, format, dst);
+        break;
+    }
+    }
+    return;
+}
+
+void Camera::PixelConvert::fromRGB(const unsigned char *rgb, int w, int h, int format, unsigned char *dst,
+                                   std::vector<unsigned char> &buffer)
+{
+    int srcStride = Jpeg::align4(w, 3);
+    int cw = (w + 1)/2;
+    int ch = (h + 1)/2;
+    switch (format) {
+    case Output_BGR24:
+        libyuv::RAWToRGB24(rgb, srcStride, dst, stride(format, w), w, h);
+        return;
+    case Output_BGRA:
+        libyuv::RAWToARGB(rgb, srcStride, dst, w*4, w, h);
+        return;
+    case Output_GRAY8:
+    case Output_I420:
+    case Output_NV12:
+        break;
+    default:
+        libyuv::CopyPlane(rgb, srcStride, dst, stride(format, w), w*3, h);
+        return;
+    }
+    /* MJPEG is full range, go through ARGB to the JPEG matrix */
+    std::size_t sizeARGB = std::size_t(w)*h*4;
+    std::size_t sizeI420 = length(Output_I420, w, h);
+    if (buffer.size() < sizeARGB + sizeI420) {
+        buffer.resize(sizeARGB + sizeI420);
+    }
+    unsigned char* argb = buffer.data();
+    libyuv::RAWToARGB(rgb, srcStride, argb, w*4, w, h);
+    if (format == Output_GRAY8) {
+        libyuv::ARGBToJ400(argb, w*4, dst, stride(format, w), w, h);
+    } else if (format == Output_I420) {
+        libyuv::ARGBToJ420(argb, w*4, dst, w, dst + w*h, cw, dst + w*h + cw*ch, cw, w, h);
+    } else {
+        unsigned char* i420 = argb + sizeARGB;
+        libyuv::ARGBToJ420(argb, w*4, i420, w, i420 + w*h, cw, i420 + w*h + cw*ch, cw, w, h);
+        libyuv::I420ToNV12(i420, w, i420 + w*h, cw, i420 + w*h + cw*ch, cw, dst, w, dst + w*h, cw*2, w, h);
+    }
+    return;
+}
@@ -0,0 +1,56 @@
+#ifndef PIXELCONVERT_H
+#define PIXELCONVERT_H
+#include <vector>
+#include "libyuv.h"
+#include "jpegwrap.h"
+
+namespace Camera {
+
+/* pixel format handed to frame consumers, byte order as laid out in memory */
+enum OutputFormat {
+    Output_NATIVE = 0,  /* RGB24 for MJPEG, BGRA for YUYV */
+    Output_RGB24,       /* R,G,B */
+    Output_BGR24,       /* B,G,R, OpenCV default */
+    Output_BGRA,        /* B,G,R,A, QImage::Format_ARGB32 */
+    Output_GRAY8,
+    Output_NV12,        /* Y plane, interleaved UV plane */
+    Output_I420         /* Y, U, V planes */
+};
+
+/*
+    one libyuv call per frame wherever libyuv has a direct kernel.
+    planar outputs are contiguous: chroma follows the Y plane.
+    YUV outputs keep the range of the source: full for MJPEG, video for YUYV.
+*/
+class PixelConvert
+{
+public:
+    /* bytes per row of the first plane */
+    static int stride(int format, int w);
+    static unsigned long length(int format, int w, int h);
+    static int channels(int format);
+    /*
+        Jpeg::Planar as produced by Jpeg::Decompressor::decodeYUV() or fromYUY2(),
+        buffer holds the resampled chroma of NV12 output from 4:2:2 and 4:4:4 planes
+    */
+    static void fromPlanar(const Jpeg::Planar &yuv, bool fullRange, int format, unsigned char* dst,
+                           std::vector<unsigned char> *buffer=nullptr);
+    static void scalePlanar(const Jpeg::Planar &src, Jpeg::Planar &dst,
+                            std::vector<unsigned char> &buffer, int w, int h);
+    /* resize an image already in output format */
+    static void scale(int format, const unsigned char* src, int srcWidth, int srcHeight, int srcStride,
+                      unsigned char* dst, int dstWidth, int dstHeight, int dstStride,
+                      libyuv::FilterMode filter=libyuv::kFilterBox);
+    /* packed YUYV to any output format, srcStride 0: rows of w pixels back to back */
+    static void fromYUY2(const unsigned char* yuy2, int w, int h, int format, unsigned char* dst,
+                         std::vector<unsigned char> &buffer, int srcStride=0);
+    /* YUYV to I422 planes in buffer */
+    static void toPlanar(const unsigned char* yuy2, int w, int h, Jpeg::Planar &yuv,
+                         std::vector<unsigned char> &buffer, int srcStride=0);
+    /* R,G,B rows (stride 4-byte aligned) to any output format, used when planar decoding fails */
+    static void fromRGB(const unsigned char* rgb, int w, int h, int format, unsigned char* dst,
+                        std::vector<unsigned char> &buffer);
+};
+
+}
+#endif // PIXELCONVERT_H
@@ -0,0 +1,355 @@
+#include "recorder.h"
+#include "camera.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+
+Camera::Recorder::Recorder()
+    :fd(-1),mem(nullptr),capacity(0),offset(0)
+{
+
+}
+
+Camera::Recorder::~Recorder()
+{
+    stop();
+}
+
+bool Camera::Recorder::reserve(uint64_t size)
+{
+    if (offset + size <= capacity) {
+        return true;
+    }
+    uint64_t newCapacity = capacity;
+    while (offset + size > newCapacity) {
+        newCapacity += grow_size;
+    }
+    if (ftruncate(fd, newCapacity) == -1) {
+        perror("Recorder: fail to ftruncate");
+        return false;
+    }
+    void *ptr = nullptr;
+    if (mem == nullptr) {
+        ptr = mmap(NULL, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        ptr = mremap(mem, capacity, newCapacity, MREMAP_MAYMOVE);
+    }
+    if (ptr == MAP_FAILED) {
+        perror("Recorder: fail to map file");
+        return false;
+    }
+    mem = (unsigned char*)ptr;
+    capacity = newCapacity;
+    return true;
+}
+
+int Camera::Recorder::start(const std::string &fileName)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (fd != -1) {
+        return 0;
+    }
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Recorder: fail to open file");
+        return -1;
+    }
+    offset = 0;
+    index.clear();
+    if (reserve(sizeof(Record::FileHeader)) == false) {
+        ::close(fd);
+        fd = -1;
+        return -2;
+    }
+    Record::FileHeader *header = (Record::FileHeader*)mem;
+    memset(header, 0, sizeof(Record::FileHeader));
+    memcpy(header->magic, Record::magic, sizeof(Record::magic));
+    header->version = Record::version;
+    header->headerSize = sizeof(Record::FileHeader);
+    offset = (sizeof(Record::FileHeader) + Record::align - 1)/Record::align*Record::align;
+    return 0;
+}
+
+void Camera::Recorder::stop()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (fd == -1) {
+        return;
+    }
+    /* index */
+    uint64_t indexSize = index.size()*sizeof(uint64_t);
+    if (reserve(indexSize)) {
+        memcpy(mem + offset, index.data(), indexSize);
+        Record::FileHeader *header = (Record::FileHeader*)mem;
+        header->frameCount = index.size();
+        header->indexOffset = offset;
+        offset += indexSize;
+    }
+    if (mem != nullptr) {
+        msync(mem, offset, MS_SYNC);
+        munmap(mem, capacity);
+        mem = nullptr;
+    }
+    if (ftruncate(fd, offset) == -1) {
+        perror("Recorder: fail to ftruncate");
+    }
+    ::close(fd);
+    fd = -1;
+    capacity = 0;
+    offset = 0;
+    return;
+}
+
+bool Camera::Recorder::isRecording()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return fd != -1;
+}
+
+std::size_t Camera::Recorder::frameCount()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return index.size();
+}
+
+void Camera::Recorder::record(const FrameInfo &info, const unsigned char *data, unsigned long length)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (fd == -1) {
+        return;
+    }
+    uint64_t size = (sizeof(Record::RecordHeader) + length + Record::align - 1)/Record::align*Record::align;
+    if (reserve(size) == false) {
+        return;
+    }
+    Record::RecordHeader *header = (Record::RecordHeader*)(mem + offset);
+    header->timestamp = info.timestamp;
+    header->sequence = info.sequence;
+    header->pixelFormat = info.pixelFormat;
+    header->width = info.width;
+    header->height = info.height;
+    header->bytesperline = info.bytesperline;
+    header->flags = info.flags;
+    header->length = length;
+    memcpy(mem + offset + sizeof(Record::RecordHeader), data, length);
+    index.push_back(offset);
+    offset += size;
+    return;
+}
+
+Camera::Replay::Replay(IDecoder *decoder_)
+    :fd(-1),mem(nullptr),totalSize(0),position(0),decoder(decoder_),
+      mode(Mode_PACED),loop(false),isRunning(false)
+{
+
+}
+
+Camera::Replay::~Replay()
+{
+    stop();
+    close();
+}
+
+int Camera::Replay::open(const std::string &fileName)
+{
+    close();
+    fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("Replay: fail to open file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(Record::FileHeader)) {
+        fprintf(stderr, "Replay: invalid file\n");
+        close();
+        return -2;
+    }
+    totalSize = st.st_size;
+    void *ptr = mmap(NULL, totalSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("Replay: fail to mmap");
+        close();
+        return -3;
+    }
+    mem = (unsigned char*)ptr;
+    const Record::FileHeader *header = (const Record::FileHeader*)mem;
+    if (memcmp(header->magic, Record::magic, sizeof(Record::magic)) != 0 ||
+            header->version != Record::version) {
+        fprintf(stderr, "Replay: unsupported file\n");
+        close();
+        return -4;
+    }
+    if (header->indexOffset == 0) {
+        /* the recording was not stopped */
+        scanRecords();
+    } else if (header->indexOffset < sizeof(Record::FileHeader) || header->indexOffset > totalSize ||
+               header->frameCount > (totalSize - header->indexOffset)/sizeof(uint64_t)) {
+        /* truncated or corrupt trailer, the records may still be intact */
+        fprintf(stderr, "Replay: index out of the file\n");
+        scanRecords();
+    } else {
+        const uint64_t *offsets = (const uint64_t*)(mem + header->indexOffset);
+        index.reserve(header->frameCount);
+        for (uint64_t i = 0; i < header->frameCount; i++) {
+            if (!isValidRecord(offsets[i])) {
+                fprintf(stderr, "Replay: record %llu out of the file, index cut there\n",
+                        (unsigned long long)i);
+                break;
+            }
+            index.push_back(offsets[i]);
+        }
+    }
+    position = 0;
+    if (index.empty()) {
+        return 0;
+    }
+    /* configure decoder from the first frame */
+    FrameInfo info;
+    frameInfo(0, info);
+    std::string format = info.pixelFormat == V4L2_PIX_FMT_MJPEG ? CAMERA_PIXELFORMAT_JPEG : CAMERA_PIXELFORMAT_YUYV;
+    decoder->setFormat(info.width, info.height, format);
+    /* blocks of the previous size are not used again */
+    FramePool::instance().trim();
+    return 0;
+}
+
+bool Camera::Replay::isValidRecord(uint64_t offset) const
+{
+    if (offset < sizeof(Record::FileHeader) || offset > totalSize ||
+            totalSize - offset < sizeof(Record::RecordHeader)) {
+        return false;
+    }
+    const Record::RecordHeader *header = (const Record::RecordHeader*)(mem + offset);
+    return header->length <= totalSize - offset - sizeof(Record::RecordHeader);
+}
+
+void Camera::Replay::scanRecords()
+{
+    uint64_t offset = (sizeof(Record::FileHeader) + Record::align - 1)/Record::align*Record::align;
+    while (isValidRecord(offset)) {
+        const Record::RecordHeader *header = (const Record::RecordHeader*)(mem + offset);
+        /* the file grows in zeroed steps, the first empty record ends the capture */
+        if (header->length == 0) {
+            break;
+        }
+        index.push_back(offset);
+        offset += (sizeof(Record::RecordHeader) + header->length + Record::align - 1)/Record::align*Record::align;
+    }
+    fprintf(stderr, "Replay: no index, %zu records found\n", index.size());
+    return;
+}
+
+void Camera::Replay::close()
+{
+    if (mem != nullptr) {
+        munmap(mem, totalSize);
+        mem = nullptr;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    totalSize = 0;
+    position = 0;
+    index.clear();
+    return;
+}
+
+bool Camera::Replay::seek(std::size_t i)
+{
+    if (i >= index.size()) {
+        return false;
+    }
+    position = i;
+    return true;
+}
+
+bool Camera::Replay::frameInfo(std::size_t i, FrameInfo &info)
+{
+    if (i >= index.size() || !isValidRecord(index[i])) {
+        return false;
+    }
+    const Record::RecordHeader *header = (const Record::RecordHeader*)(mem + index[i]);
+    info.timestamp = header->timestamp;
+    info.sequence = header->sequence;
+    info.bytesused = header->length;
+    info.flags = header->flags;
+    info.pixelFormat = header->pixelFormat;
+    info.width = header->width;
+    info.height = header->height;
+    info.bytesperline = header->bytesperline;
+    info.error = (header->flags & V4L2_BUF_FLAG_ERROR) != 0;
+    return true;
+}
+
+bool Camera::Replay::next()
+{
+    FrameInfo info;
+    if (frameInfo(position, info) == false) {
+        return false;
+    }
+    unsigned char* data = mem + index[position] + sizeof(Record::RecordHeader);
+    position++;
+    decoder->sample(FrameLease(data, info.bytesused, info));
+    return true;
+}
+
+void Camera::Replay::run()
+{
+    printf("enter replay function.\n");
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point t0 = Clock::now();
+    long long ts0 = 0;
+    bool first = true;
+    while (isRunning.load()) {
+        if (position >= index.size()) {
+            if (!loop || index.empty()) {
+                break;
+            }
+            position = 0;
+            first = true;
+        }
+        if (mode == Mode_PACED) {
+            FrameInfo info;
+            frameInfo(position, info);
+            if (first) {
+                t0 = Clock::now();
+                ts0 = info.timestamp;
+                first = false;
+            }
+            std::this_thread::sleep_until(t0 + std::chrono::microseconds(info.timestamp - ts0));
+        }
+        next();
+    }
+    isRunning.store(false);
+    printf("leave replay function.\n");
+    return;
+}
+
+int Camera::Replay::start(int mode_, bool loop_)
+{
+    if (mem == nullptr) {
+        return -1;
+    }
+    stop();
+    mode = mode_;
+    loop = loop_;
+    decoder->start();
+    isRunning.store(true);
+    replayThread = std::thread(&Replay::run, this);
+    return 0;
+}
+
+void Camera::Replay::stop()
+{
+    isRunning.store(false);
+    if (replayThread.joinable()) {
+        replayThread.join();
+        decoder->stop();
+    }
+    return;
+}
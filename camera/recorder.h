@@ -0,0 +1,117 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "framelease.h"
+
+namespace Camera {
+
+class IDecoder;
+
+/*
+    container of raw capture payloads (MJPEG bytes or YUYV planes)
+
+    | FileHeader | RecordHeader payload | ... | uint64_t index[frameCount] |
+
+    records start on a 64-byte boundary, index holds their file offsets.
+    the index is written by Recorder::stop(), without it Replay scans the records.
+*/
+namespace Record {
+
+constexpr char magic[8] = {'V', '4', 'L', 'R', 'E', 'C', '0', '1'};
+constexpr uint32_t version = 1;
+constexpr uint64_t align = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t frameCount;
+    uint64_t indexOffset;
+    uint8_t reserved[32];
+};
+
+struct RecordHeader {
+    int64_t timestamp;
+    uint32_t sequence;
+    uint32_t pixelFormat;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesperline;
+    uint32_t flags;
+    uint64_t length;
+};
+
+}
+
+class Recorder
+{
+public:
+    /* the file grows by this much each time it is remapped */
+    constexpr static uint64_t grow_size = 64<<20;
+protected:
+    int fd;
+    unsigned char* mem;
+    uint64_t capacity;
+    uint64_t offset;
+    std::vector<uint64_t> index;
+    std::mutex mutex;
+protected:
+    bool reserve(uint64_t size);
+public:
+    Recorder();
+    ~Recorder();
+    int start(const std::string &fileName);
+    void stop();
+    bool isRecording();
+    std::size_t frameCount();
+    /* called from FrameSource::dispatch() */
+    void record(const FrameInfo &info, const unsigned char* data, unsigned long length);
+};
+
+class Replay
+{
+public:
+    enum Mode {
+        Mode_PACED = 0,
+        Mode_FAST
+    };
+protected:
+    int fd;
+    unsigned char* mem;
+    uint64_t totalSize;
+    std::vector<uint64_t> index;
+    std::size_t position;
+    IDecoder *decoder;
+    int mode;
+    bool loop;
+    std::atomic<bool> isRunning;
+    std::thread replayThread;
+protected:
+    /* header and payload of the record at offset lie inside the file */
+    bool isValidRecord(uint64_t offset) const;
+    /* index of a file whose trailer was never written, e.g. after a crash */
+    void scanRecords();
+    void run();
+public:
+    explicit Replay(IDecoder *decoder_);
+    ~Replay();
+    int open(const std::string &fileName);
+    void close();
+    std::size_t frameCount() const {return index.size();}
+    bool seek(std::size_t i);
+    bool frameInfo(std::size_t i, FrameInfo &info);
+    /* feed the next frame on the calling thread, false at end of file */
+    bool next();
+    /* feed frames on a replay thread */
+    int start(int mode_=Mode_PACED, bool loop_=false);
+    void stop();
+    bool isFinished() const {return !isRunning.load();}
+};
+
+}
+#endif // RECORDER_H
@@ -0,0 +1,287 @@
+#include "restartdecoder.h"
+#include <algorithm>
+
+static inline int readUint16(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+Camera::RestartDecoder::RestartDecoder(int threadCount_)
+    :threadCount(std::max(threadCount_, 1)),isRunning(true),generation(0),
+      nextBand(0),pendingBands(0),scale(Jpeg::SCALE_D1)
+{
+    /* the calling thread decodes a band too */
+    for (int i = 1; i < threadCount; i++) {
+        workers.push_back(std::thread(&RestartDecoder::run, this));
+    }
+}
+
+Camera::RestartDecoder::~RestartDecoder()
+{
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        isRunning = false;
+    }
+    condit.notify_all();
+    for (std::size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+int Camera::RestartDecoder::parse(const uint8_t *jpeg, std::size_t totalsize, Layout &layout)
+{
+    layout.width = 0;
+    layout.height = 0;
+    layout.restartInterval = 0;
+    layout.scanOffset = 0;
+    layout.markers.clear();
+    if (jpeg == nullptr || totalsize < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return -1;
+    }
+    int maxH = 1;
+    int maxV = 1;
+    int components = 0;
+    std::size_t pos = 2;
+    while (pos + 4 <= totalsize) {
+        if (jpeg[pos] != 0xFF) {
+            return -1;
+        }
+        uint8_t marker = jpeg[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        std::size_t length = readUint16(jpeg + pos + 2);
+        if (length < 2 || pos + 2 + length > totalsize) {
+            return -1;
+        }
+        if (marker == 0xC0 || marker == 0xC1) {
+            /* baseline or extended huffman, single scan */
+            if (length < 8) {
+                return -1;
+            }
+            layout.sofOffset = pos;
+            layout.height = readUint16(jpeg + pos + 5);
+            layout.width = readUint16(jpeg + pos + 7);
+            components = jpeg[pos + 9];
+            if (components != 3 || length < std::size_t(8 + 3*components)) {
+                return -1;
+            }
+            for (int i = 0; i < components; i++) {
+                uint8_t sampling = jpeg[pos + 11 + 3*i];
+                maxH = std::max(maxH, sampling >> 4);
+                maxV = std::max(maxV, sampling & 0x0F);
+            }
+        } else if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)) {
+            /* progressive, lossless and arithmetic frames restart per scan */
+            return -1;
+        } else if (marker == 0xDD) {
+            layout.restartInterval = readUint16(jpeg + pos + 4);
+        } else if (marker == 0xDA) {
+            /* one interleaved scan of every component */
+            if (jpeg[pos + 4] != components) {
+                return -1;
+            }
+            layout.scanOffset = pos + 2 + length;
+            break;
+        }
+        pos += 2 + length;
+    }
+    if (layout.width == 0 || layout.height == 0 ||
+            layout.restartInterval == 0 || layout.scanOffset == 0) {
+        return -1;
+    }
+    layout.mcuWidth = 8*maxH;
+    layout.mcuHeight = 8*maxV;
+    /* some cameras pad the payload after EOI */
+    std::size_t end = totalsize;
+    while (end > layout.scanOffset + 2 && jpeg[end - 1] == 0x00) {
+        end--;
+    }
+    if (end < layout.scanOffset + 2 || jpeg[end - 2] != 0xFF || jpeg[end - 1] != 0xD9) {
+        return -1;
+    }
+    layout.eoiOffset = end - 2;
+    /* entropy coded data: 0xFF is stuffed as FF 00, FF FF is fill before a marker */
+    const uint8_t* p = jpeg + layout.scanOffset;
+    const uint8_t* last = jpeg + layout.eoiOffset;
+    while (p < last) {
+        p = (const uint8_t*)memchr(p, 0xFF, last - p);
+        if (p == nullptr || p + 1 >= last) {
+            break;
+        }
+        uint8_t marker = p[1];
+        if (marker >= 0xD0 && marker <= 0xD7) {
+            layout.markers.push_back(p - jpeg);
+            p += 2;
+        } else if (marker == 0x00) {
+            p += 2;
+        } else if (marker == 0xFF) {
+            p += 1;
+        } else {
+            /* DNL or a second scan, not a plain restart layout */
+            return -1;
+        }
+    }
+    long long mcuCount = (long long)((layout.width + layout.mcuWidth - 1)/layout.mcuWidth)*
+            ((layout.height + layout.mcuHeight - 1)/layout.mcuHeight);
+    long long intervals = (mcuCount + layout.restartInterval - 1)/layout.restartInterval;
+    if (layout.markers.empty() || (long long)layout.markers.size() + 1 != intervals) {
+        return -1;
+    }
+    return 0;
+}
+
+bool Camera::RestartDecoder::split(const uint8_t *jpeg, std::vector<Band> &out) const
+{
+    long long mcuPerRow = (layout.width + layout.mcuWidth - 1)/layout.mcuWidth;
+    int mcuRows = (layout.height + layout.mcuHeight - 1)/layout.mcuHeight;
+    long long interval = layout.restartInterval;
+    long long intervals = layout.markers.size() + 1;
+    int bandCount = std::min(threadCount, mcuRows/min_band_rows);
+    if (bandCount < 2) {
+        return false;
+    }
+    /* bands start on intervals that start an MCU row */
+    std::vector<long long> boundary(1, 0);
+    for (int i = 1; i < bandCount; i++) {
+        long long row = (long long)i*mcuRows/bandCount;
+        long long k = (row*mcuPerRow + interval - 1)/interval;
+        while (k < intervals && (k*interval) % mcuPerRow != 0) {
+            k++;
+        }
+        if (k >= intervals) {
+            break;
+        }
+        if (k > boundary.back()) {
+            boundary.push_back(k);
+        }
+    }
+    if (boundary.size() < 2) {
+        return false;
+    }
+    boundary.push_back(intervals);
+    out.resize(boundary.size() - 1);
+    for (std::size_t i = 0; i < out.size(); i++) {
+        Band &band = out[i];
+        long long first = boundary[i];
+        long long end = boundary[i + 1];
+        band.row = first*interval/mcuPerRow;
+        band.ret = 0;
+        int endRow = end == intervals ? mcuRows : end*interval/mcuPerRow;
+        int height = std::min(layout.height, endRow*layout.mcuHeight) - band.row*layout.mcuHeight;
+        /* tables and headers as is, SOF carries the height of the band */
+        band.jpeg.assign(jpeg, jpeg + layout.scanOffset);
+        band.jpeg[layout.sofOffset + 5] = height >> 8;
+        band.jpeg[layout.sofOffset + 6] = height & 0xFF;
+        for (long long k = first; k < end; k++) {
+            std::size_t from = k == 0 ? layout.scanOffset : layout.markers[k - 1] + 2;
+            std::size_t to = k == intervals - 1 ? layout.eoiOffset : layout.markers[k];
+            band.jpeg.insert(band.jpeg.end(), jpeg + from, jpeg + to);
+            if (k + 1 < end) {
+                /* the decoder expects RST0 after the first interval of a scan */
+                band.jpeg.push_back(0xFF);
+                band.jpeg.push_back(0xD0 + ((k - first) & 7));
+            }
+        }
+        band.jpeg.push_back(0xFF);
+        band.jpeg.push_back(0xD9);
+    }
+    return true;
+}
+
+void Camera::RestartDecoder::decodeBands(Jpeg::Decompressor &decompressor)
+{
+    while (1) {
+        int index = 0;
+        Jpeg::Planar planar;
+        int bandScale = 0;
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            if (nextBand >= (int)bands.size() || pendingBands == 0) {
+                break;
+            }
+            index = nextBand++;
+            planar = target;
+            bandScale = scale;
+        }
+        Band &band = bands[index];
+        /* one iMCU row of the scaled output per MCU row */
+        int rowY = band.row*layout.mcuHeight/bandScale;
+        int rowUV = planar.subsample == Jpeg::SUBSAMPLE_420 ? rowY/2 : rowY;
+        planar.y += std::size_t(rowY)*planar.strideY;
+        planar.u += std::size_t(rowUV)*planar.strideUV;
+        planar.v += std::size_t(rowUV)*planar.strideUV;
+        int ret = decompressor.decodeYUVTo(planar, band.jpeg.data(), band.jpeg.size(), bandScale);
+        std::unique_lock<std::mutex> locker(mutex);
+        band.ret = ret;
+        pendingBands--;
+        if (pendingBands == 0) {
+            finished.notify_all();
+        }
+    }
+    return;
+}
+
+void Camera::RestartDecoder::run()
+{
+    /* libjpeg state of this worker, reused by every band it decodes */
+    Jpeg::Decompressor decompressor;
+    unsigned long seen = 0;
+    while (1) {
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            condit.wait(locker, [this, seen]()->bool{
+                return !isRunning || generation != seen;
+            });
+            if (!isRunning) {
+                break;
+            }
+            seen = generation;
+        }
+        decodeBands(decompressor);
+    }
+    return;
+}
+
+int Camera::RestartDecoder::decodeYUV(Jpeg::Decompressor &decompressor, Jpeg::Planar &yuv,
+                                      std::vector<uint8_t> &buffer,
+                                      uint8_t *jpeg, std::size_t totalsize, int scale_)
+{
+    std::unique_lock<std::mutex> busy(decodeMutex, std::try_to_lock);
+    if (!busy.owns_lock() || threadCount < 2) {
+        return 1;
+    }
+    if (parse(jpeg, totalsize, layout) != 0 ||
+            layout.mcuHeight % scale_ != 0 || !split(jpeg, nextBands)) {
+        return 1;
+    }
+    int ret = decompressor.layoutYUV(yuv, buffer, jpeg, totalsize, scale_);
+    if (ret != 0) {
+        return ret;
+    }
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        /* the previous bands keep their capacity for the next split */
+        bands.swap(nextBands);
+        target = yuv;
+        scale = scale_;
+        nextBand = 0;
+        pendingBands = bands.size();
+        generation++;
+    }
+    condit.notify_all();
+    decodeBands(decompressor);
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        finished.wait(locker, [this]()->bool{
+            return pendingBands == 0;
+        });
+    }
+    for (std::size_t i = 0; i < bands.size(); i++) {
+        if (bands[i].ret != 0) {
+            return bands[i].ret;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef RESTARTDECODER_H
+#define RESTARTDECODER_H
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include "jpegwrap.h"
+
+namespace Camera {
+
+/*
+    intra-frame parallel MJPEG decode.
+    DC predictors reset at every restart marker, so a run of restart intervals
+    covering whole MCU rows is a complete scan on its own: each band is rewritten
+    as a standalone JPEG (same tables, SOF height of the band, RST renumbered)
+    and decoded on its own thread straight into the rows of the shared planes.
+*/
+class RestartDecoder
+{
+public:
+    /* fewer MCU rows per band are not worth a thread */
+    constexpr static int min_band_rows = 2;
+    struct Band {
+        std::vector<uint8_t> jpeg;
+        int row;            /* first MCU row */
+        int ret;
+    };
+    /* restart layout of a frame, offsets into the source buffer */
+    struct Layout {
+        int width;
+        int height;
+        int mcuWidth;
+        int mcuHeight;
+        int restartInterval;
+        std::size_t sofOffset;
+        std::size_t scanOffset;
+        std::size_t eoiOffset;
+        /* offset of each RST marker in the entropy coded data */
+        std::vector<std::size_t> markers;
+    };
+protected:
+    int threadCount;
+    bool isRunning;
+    unsigned long generation;
+    int nextBand;
+    int pendingBands;
+    Jpeg::Planar target;
+    int scale;
+    Layout layout;
+    /* bands of the frame the workers decode, only changed under mutex */
+    std::vector<Band> bands;
+    /* bands of the next frame, built by the decodeMutex holder */
+    std::vector<Band> nextBands;
+    std::vector<std::thread> workers;
+    /* held by the frame being decoded, other callers fall back to serial */
+    std::mutex decodeMutex;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::condition_variable finished;
+protected:
+    static int parse(const uint8_t* jpeg, std::size_t totalsize, Layout &layout);
+    bool split(const uint8_t* jpeg, std::vector<Band> &out) const;
+    void decodeBands(Jpeg::Decompressor &decompressor);
+    void run();
+public:
+    explicit RestartDecoder(int threadCount_);
+    ~RestartDecoder();
+    RestartDecoder(const RestartDecoder &r) = delete;
+    RestartDecoder& operator=(const RestartDecoder &r) = delete;
+    int getThreadCount() const {return threadCount;}
+    /*
+        same result as Jpeg::Decompressor::decodeYUV(), planes placed in buffer.
+        1: no usable restart markers or busy, decode serially.
+    */
+    int decodeYUV(Jpeg::Decompressor &decompressor, Jpeg::Planar &yuv, std::vector<uint8_t> &buffer,
+                  uint8_t *jpeg, std::size_t totalsize, int scale_=Jpeg::SCALE_D1);
+};
+
+}
+#endif // RESTARTDECODER_H
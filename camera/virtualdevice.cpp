@@ -0,0 +1,217 @@
+#include "virtualdevice.h"
+#include <time.h>
+#include <chrono>
+#include <algorithm>
+
+/* 3x5 digits, one row per 3 bits */
+static const unsigned char digitFont[10][5] = {
+    {7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+    {7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7}
+};
+
+Camera::VirtualDevice::VirtualDevice(int decodeType, const Camera::FnProcessImage &func)
+    :VirtualDevice(decodeType, toProcessFrame(func))
+{
+
+}
+
+Camera::VirtualDevice::VirtualDevice(int decodeType, const Camera::FnProcessFrame &func)
+    :FrameSource(decodeType, func),width(0),height(0),pixelFormat(0),
+      pregenerate(default_pregenerate),sequence(0),seed(2463534242u)
+{
+
+}
+
+Camera::VirtualDevice::~VirtualDevice()
+{
+    stop();
+    rgb.clear();
+    argb.clear();
+}
+
+void Camera::VirtualDevice::drawNumber(unsigned long long value, int x, int y, int scale)
+{
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%llu", value);
+    int glyphWidth = 4*scale;
+    /* background */
+    for (int i = y - scale; i < y + 6*scale && i < height; i++) {
+        if (i < 0) {
+            continue;
+        }
+        int x1 = std::min(x + len*glyphWidth + scale, width);
+        for (int j = std::max(x - scale, 0); j < x1; j++) {
+            unsigned char* p = rgb.data + (i*width + j)*3;
+            p[0] = p[1] = p[2] = 0;
+        }
+    }
+    for (int k = 0; k < len; k++) {
+        const unsigned char* glyph = digitFont[text[k] - '0'];
+        for (int r = 0; r < 5*scale; r++) {
+            int i = y + r;
+            if (i < 0 || i >= height) {
+                continue;
+            }
+            unsigned char bits = glyph[r/scale];
+            for (int c = 0; c < 3*scale; c++) {
+                int j = x + k*glyphWidth + c;
+                if (j < 0 || j >= width || !(bits & (4 >> (c/scale)))) {
+                    continue;
+                }
+                unsigned char* p = rgb.data + (i*width + j)*3;
+                p[0] = p[1] = p[2] = 255;
+            }
+        }
+    }
+    return;
+}
+
+void Camera::VirtualDevice::render(unsigned int index, long long timestamp)
+{
+    unsigned char* p = rgb.data;
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            /* xorshift noise */
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            int noise = (int)(seed & 0xf) - 8;
+            int r = ((j + index*4) & 0xff) + noise;
+            int g = ((i + index*2) & 0xff) + noise;
+            int b = (((i + j)/2 + index*3) & 0xff) + noise;
+            p[0] = r < 0 ? 0 : (r > 255 ? 255 : r);
+            p[1] = g < 0 ? 0 : (g > 255 ? 255 : g);
+            p[2] = b < 0 ? 0 : (b > 255 ? 255 : b);
+            p += 3;
+        }
+    }
+    int scale = std::max(height/120, 1);
+    drawNumber(timestamp/1000, 2*scale, 2*scale, scale);
+    drawNumber(index, 2*scale, 9*scale, scale);
+    return;
+}
+
+int Camera::VirtualDevice::encode(Frame &frame)
+{
+    if (formatString == CAMERA_PIXELFORMAT_JPEG) {
+        uint8_t* jpeg = nullptr;
+        std::size_t totalsize = 0;
+        if (Jpeg::encode(jpeg, totalsize, rgb.data, width, height, width*3) != 0) {
+            return -1;
+        }
+        frame.copy(jpeg, totalsize);
+        free(jpeg);
+    } else {
+        int alignedWidth = (width + 1) & ~1;
+        frame.allocate(alignedWidth*2*height);
+        libyuv::RAWToARGB(rgb.data, width*3, argb.data, width*4, width, height);
+        libyuv::ARGBToYUY2(argb.data, width*4, frame.data, alignedWidth*2, width, height);
+    }
+    return 0;
+}
+
+void Camera::VirtualDevice::onSample()
+{
+    printf("enter virtual sampling function.\n");
+    using Clock = std::chrono::steady_clock;
+    std::chrono::microseconds interval((long long)(1000000/frameRate));
+    Clock::time_point next = Clock::now();
+    Frame live;
+    while (isRunning.load()) {
+        std::this_thread::sleep_until(next);
+        next += interval;
+        if (Clock::now() > next + interval) {
+            /* the consumer is behind, do not burst */
+            next = Clock::now();
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        long long timestamp = (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+        Frame *frame = &live;
+        if (frames.empty()) {
+            render(sequence, timestamp);
+            encode(live);
+        } else {
+            frame = &frames[sequence%frames.size()];
+        }
+        FrameInfo info;
+        info.timestamp = timestamp;
+        info.sequence = sequence;
+        info.bytesused = frame->length;
+        info.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        info.pixelFormat = pixelFormat;
+        info.width = width;
+        info.height = height;
+        info.bytesperline = pixelFormat == V4L2_PIX_FMT_YUYV ? ((width + 1) & ~1)*2 : 0;
+        /* pregenerated frames are immutable until stop(), consumers may hold them */
+        dispatch(FrameLease(frame->data, frame->length, info, !frames.empty()));
+        sequence++;
+    }
+    live.clear();
+    printf("leave virtual sampling function.\n");
+    return;
+}
+
+int Camera::VirtualDevice::start(const std::string &format, const std::string &res, double fps)
+{
+    if (isRunning.load()) {
+        return 0;
+    }
+    if (format != CAMERA_PIXELFORMAT_JPEG && format != CAMERA_PIXELFORMAT_YUYV) {
+        printf("VirtualDevice::start: unsupported format %s\n", format.c_str());
+        return -7;
+    }
+    std::vector<std::string> resList = Strings::split(res, "*");
+    if (resList.size() != 2) {
+        printf("VirtualDevice::start: invalid resolution\n");
+        return -7;
+    }
+    width = std::atoi(resList[0].c_str());
+    height = std::atoi(resList[1].c_str());
+    if (width <= 0 || height <= 0) {
+        return -7;
+    }
+    formatString = format;
+    pixelFormat = format == CAMERA_PIXELFORMAT_JPEG ? V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_YUYV;
+    frameRate = fps > 0 ? fps : 30;
+    sequence = 0;
+    rgb.allocate(width*height*3);
+    argb.allocate(width*height*4);
+    decoder->setFormat(width, height, formatString);
+    /* blocks of the previous size are not used again */
+    FramePool::instance().trim();
+    /* encode once, the benchmark then only measures the pipeline */
+    frames = std::vector<Frame>(pregenerate);
+    for (int i = 0; i < pregenerate; i++) {
+        render(i, (long long)(i*1000000/frameRate));
+        if (encode(frames[i]) != 0) {
+            printf("VirtualDevice::start: fail to encode\n");
+            return -4;
+        }
+    }
+    isRunning.store(1);
+    decoder->start();
+    sampleThread = std::thread(&VirtualDevice::onSample, this);
+    return 0;
+}
+
+void Camera::VirtualDevice::stop()
+{
+    if (isRunning.load()) {
+        isRunning.store(0);
+        sampleThread.join();
+        decoder->stop();
+    }
+    for (std::size_t i = 0; i < frames.size(); i++) {
+        frames[i].clear();
+    }
+    frames.clear();
+    return;
+}
+
+void Camera::VirtualDevice::restart(const std::string &format, const std::string &res, double fps)
+{
+    stop();
+    start(format, res, fps);
+    return;
+}
@@ -0,0 +1,45 @@
+#ifndef VIRTUALDEVICE_H
+#define VIRTUALDEVICE_H
+#include "camera.h"
+
+namespace Camera {
+
+/*
+    synthetic test-pattern camera: moving gradient, noise and a timestamp overlay,
+    encoded as MJPEG or YUYV and fed through the same FrameSource path as Device.
+*/
+class VirtualDevice : public FrameSource
+{
+public:
+    constexpr static int default_pregenerate = 60;
+protected:
+    int width;
+    int height;
+    std::string formatString;
+    unsigned int pixelFormat;
+    /* frames encoded once at start, 0: generate every frame */
+    int pregenerate;
+    unsigned int sequence;
+    unsigned int seed;
+    std::thread sampleThread;
+    Frame rgb;
+    Frame argb;
+    std::vector<Frame> frames;
+protected:
+    void render(unsigned int index, long long timestamp);
+    void drawNumber(unsigned long long value, int x, int y, int scale);
+    int encode(Frame &frame);
+    void onSample();
+public:
+    explicit VirtualDevice(int decodeType, const FnProcessImage &func);
+    explicit VirtualDevice(int decodeType, const FnProcessFrame &func);
+    ~VirtualDevice();
+    void setPregenerate(int count) {pregenerate = count;}
+    /* format: JPEG or YUYV, res: w*h */
+    int start(const std::string &format, const std::string &res, double fps=30);
+    virtual void stop() override;
+    virtual void restart(const std::string &format, const std::string &res, double fps=30) override;
+};
+
+}
+#endif // VIRTUALDEVICE_H
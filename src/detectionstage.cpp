@@ -0,0 +1,165 @@
+#include "detectionstage.h"
+
+DetectionStage::DetectionStage()
+    :isRunning(false),hasFrame(false),pendingWidth(0),pendingHeight(0),
+      pendingType(Yolov5::PIXEL_RGB),hasResult(false),skippedCount(0)
+{
+
+}
+
+DetectionStage::~DetectionStage()
+{
+    stop();
+}
+
+void DetectionStage::start(int threadCount)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (isRunning) {
+        return;
+    }
+    isRunning = true;
+    hasFrame = false;
+    hasResult = false;
+    for (int i = 0; i < std::max(threadCount, 1); i++) {
+        workers.push_back(std::thread(&DetectionStage::run, this));
+    }
+    return;
+}
+
+void DetectionStage::stop()
+{
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        if (!isRunning) {
+            return;
+        }
+        isRunning = false;
+    }
+    condit.notify_all();
+    for (std::size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+    return;
+}
+
+void DetectionStage::submit(const Camera::FrameDesc &frame)
+{
+    cv::Mat img;
+    cv::Mat chroma;
+    int pixelType = Yolov5::PIXEL_RGB;
+    if (frame.format == Camera::Output_NV12) {
+        /* Y rows then the interleaved UV rows, a UV row covers odd widths with one more byte */
+        int uvStride = (frame.width + 1)/2*2;
+        img = cv::Mat(frame.height, frame.width, CV_8UC1, frame.data, frame.stride);
+        chroma = cv::Mat((frame.height + 1)/2, uvStride, CV_8UC1,
+                         frame.data + (std::size_t)frame.stride*frame.height, uvStride);
+        /* the decoder keeps the range of the source: full for MJPEG, video for YUYV */
+        pixelType = frame.info.pixelFormat == V4L2_PIX_FMT_MJPEG ? Yolov5::PIXEL_NV12 : Yolov5::PIXEL_NV12_VIDEO;
+    } else if (frame.channels == 3) {
+        img = cv::Mat(frame.height, frame.width, CV_8UC3, frame.data, frame.stride);
+        pixelType = frame.format == Camera::Output_BGR24 ? Yolov5::PIXEL_BGR : Yolov5::PIXEL_RGB;
+    } else {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        if (!isRunning) {
+            return;
+        }
+        if (hasFrame) {
+            skippedCount++;
+        }
+        /* reuses the buffer of pending while the size stays */
+        if (chroma.empty()) {
+            img.copyTo(pending);
+        } else {
+            /* both planes at the UV row size, as Yolov5 expects one stride for NV12 */
+            pending.create(img.rows + chroma.rows, chroma.cols, CV_8UC1);
+            cv::Mat y = pending(cv::Rect(0, 0, img.cols, img.rows));
+            cv::Mat uv = pending.rowRange(img.rows, pending.rows);
+            img.copyTo(y);
+            chroma.copyTo(uv);
+        }
+        pendingInfo = frame.info;
+        pendingWidth = frame.width;
+        pendingHeight = frame.height;
+        pendingType = pixelType;
+        hasFrame = true;
+    }
+    condit.notify_one();
+    return;
+}
+
+void DetectionStage::run()
+{
+    cv::Mat img;
+    std::vector<Yolov5::Object> objects;
+    /* allocators and scratch of this worker, workers detect in parallel */
+    Yolov5::DetectContext context;
+    while (1) {
+        Camera::FrameInfo info;
+        int width = 0;
+        int height = 0;
+        int pixelType = Yolov5::PIXEL_RGB;
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            condit.wait(locker, [this]()->bool{
+                return !isRunning || hasFrame;
+            });
+            if (!isRunning) {
+                break;
+            }
+            /* take the newest frame, the old buffer becomes the next pending one */
+            cv::swap(img, pending);
+            info = pendingInfo;
+            width = pendingWidth;
+            height = pendingHeight;
+            pixelType = pendingType;
+            hasFrame = false;
+        }
+        objects.clear();
+        Yolov5::instance().detect(context, img.data, width, height, img.step, pixelType, objects);
+        std::unique_lock<std::mutex> locker(mutex);
+        /* several workers may finish out of order */
+        if (!hasResult || info.timestamp >= latest.timestamp) {
+            latest.timestamp = info.timestamp;
+            latest.sequence = info.sequence;
+            latest.width = width;
+            latest.height = height;
+            latest.objects.swap(objects);
+            hasResult = true;
+        }
+    }
+    return;
+}
+
+bool DetectionStage::getLatest(DetectionStage::Result &result)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (!hasResult) {
+        return false;
+    }
+    result = latest;
+    return true;
+}
+
+void DetectionStage::draw(cv::Mat &image, const DetectionStage::Result &result)
+{
+    if (result.width <= 0 || result.height <= 0) {
+        return;
+    }
+    float sx = float(image.cols)/result.width;
+    float sy = float(image.rows)/result.height;
+    std::vector<Yolov5::Object> objects(result.objects);
+    for (std::size_t i = 0; i < objects.size(); i++) {
+        cv::Rect_<float> &rect = objects[i].rect;
+        rect.x *= sx;
+        rect.y *= sy;
+        rect.width *= sx;
+        rect.height *= sy;
+    }
+    Yolov5::instance().draw(image, objects);
+    return;
+}
@@ -0,0 +1,61 @@
+#ifndef DETECTIONSTAGE_H
+#define DETECTIONSTAGE_H
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "camera/camera.h"
+#include "yolov5.h"
+
+/*
+    yolov5 off the capture thread.
+    submit() only copies the frame and replaces one still waiting, workers detect
+    at whatever rate they sustain on the newest frame, and the latest detections
+    are published with the timestamp of the frame they were found in.
+*/
+class DetectionStage
+{
+public:
+    struct Result {
+        long long timestamp;    /* FrameInfo::timestamp of the source frame */
+        unsigned int sequence;
+        int width;              /* size of the frame the boxes refer to */
+        int height;
+        std::vector<Yolov5::Object> objects;
+        Result():timestamp(0),sequence(0),width(0),height(0){}
+    };
+protected:
+    bool isRunning;
+    bool hasFrame;
+    /* newest submitted frame, as the decoder wrote it */
+    cv::Mat pending;
+    Camera::FrameInfo pendingInfo;
+    int pendingWidth;
+    int pendingHeight;
+    int pendingType;    /* Yolov5::PixelType */
+    Result latest;
+    bool hasResult;
+    std::atomic<unsigned long> skippedCount;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::vector<std::thread> workers;
+protected:
+    void run();
+public:
+    DetectionStage();
+    ~DetectionStage();
+    void start(int threadCount=1);
+    void stop();
+    /* called from the camera callback, never waits for a detection.
+       RGB24, BGR24 and NV12 frames go to the network without conversion */
+    void submit(const Camera::FrameDesc &frame);
+    /* false until the first detection finished */
+    bool getLatest(Result &result);
+    /* frames replaced before a worker took them */
+    unsigned long skipped() const {return skippedCount.load();}
+    /* boxes of result scaled onto an image of another size */
+    static void draw(cv::Mat &image, const Result &result);
+};
+
+#endif // DETECTIONSTAGE_H
@@ -1,40 +1,33 @@
 #include "imageprocess.h"
 #include <QDebug>
 
-void Imageprocess::canny(int height, int width, unsigned char *data)
+void Imageprocess::canny(int height, int width, int stride, unsigned char *gray)
 {
-    cv::Mat img(height, width, CV_8UC3, data);
-    cv::Mat gray;
-    cv::cvtColor(img, gray, cv::COLOR_RGB2GRAY);
-    cv::blur(gray, gray, cv::Size(3, 3));
-    cv::Canny(gray, gray, 60, 120);
-    cv::cvtColor(gray, img, cv::COLOR_GRAY2RGB);
+    cv::Mat img(height, width, CV_8UC1, gray, stride);
+    cv::Mat blurImg;
+    cv::blur(img, blurImg, cv::Size(3, 3));
+    cv::Canny(blurImg, img, 60, 120);
     return;
 }
 
-void Imageprocess::laplace(int height, int width, unsigned char *data)
+void Imageprocess::laplace(int height, int width, int stride, unsigned char *gray)
 {
-    cv::Mat img(height, width, CV_8UC3, data);
-    cv::Mat gray;
-    cv::cvtColor(img, gray, cv::COLOR_RGB2GRAY);
-    cv::GaussianBlur(gray, gray, cv::Size(3, 3), 0);
+    cv::Mat img(height, width, CV_8UC1, gray, stride);
+    cv::Mat blurImg;
+    cv::GaussianBlur(img, blurImg, cv::Size(3, 3), 0);
     cv::Mat filterImg;
-    cv::Laplacian(gray, filterImg, CV_16S, 3);
-    cv::Mat scaleImg;
-    cv::convertScaleAbs(filterImg, scaleImg);
-    cv::cvtColor(scaleImg, img, cv::COLOR_GRAY2RGB);
+    cv::Laplacian(blurImg, filterImg, CV_16S, 3);
+    cv::convertScaleAbs(filterImg, img);
     return ;
 }
 
 void Imageprocess::yolov5(int height, int width, unsigned char *data)
 {
     cv::Mat img(height, width, CV_8UC3, data);
-    {
-        ncnn::MutexLockGuard guard(Yolov5::instance().lock);
-        std::vector<Yolov5::Object> objects;
-        Yolov5::instance().detect(img, objects);
-        Yolov5::instance().draw(img, objects);
-    }
+    /* each calling thread detects with its own context */
+    std::vector<Yolov5::Object> objects;
+    Yolov5::instance().detect(img, objects);
+    Yolov5::instance().draw(img, objects);
     return;
 }
 
@@ -10,8 +10,9 @@
 class Imageprocess
 {
 public:
-    static void canny(int height, int width, unsigned char* data);
-    static void laplace(int height, int width, unsigned char* data);
+    /* gray: 8 bit luma, edges are written back in place */
+    static void canny(int height, int width, int stride, unsigned char* gray);
+    static void laplace(int height, int width, int stride, unsigned char* gray);
     static void yolov5(int height, int width, unsigned char* data);
 };
 
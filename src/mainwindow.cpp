@@ -6,6 +6,8 @@
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
+    camera(nullptr),
+    detector(nullptr),
     methodName("none")
 {
     ui->setupUi(this);
@@ -47,25 +49,47 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->methodComboBox->addItems(QStringList{"none", "canny", "laplace", "yolov5"});
     connect(ui->methodComboBox, &QComboBox::currentTextChanged, this, [=](const QString &name){
         methodName = name;
+        if (camera != nullptr) {
+            /* edge detection only needs luma */
+            camera->setOutputFormat(name == "canny" || name == "laplace" ?
+                                        Camera::Output_GRAY8 : Camera::Output_RGB24);
+        }
     });
     methodName = "none";
     ui->methodComboBox->setCurrentText(methodName);
 
-    camera = new Camera::Device(Camera::Decode_SYNC, [this](int h, int w, int c, unsigned char* data){
-        if (c == 3) {
+    /* inference runs on its own thread, the preview keeps the camera rate */
+    detector = new DetectionStage;
+    detector->start();
+    camera = new Camera::Device(Camera::Decode_SYNC, [this](const Camera::FrameDesc &frame){
+        int h = frame.height;
+        int w = frame.width;
+        if (frame.format == Camera::Output_GRAY8) {
             if (methodName == "canny") {
-                Imageprocess::canny(h, w, data);
+                Imageprocess::canny(h, w, frame.stride, frame.data);
             } else if (methodName == "laplace") {
-                Imageprocess::laplace(h, w, data);
-            } else if (methodName == "yolov5") {
-                Imageprocess::yolov5(h, w, data);
+                Imageprocess::laplace(h, w, frame.stride, frame.data);
+            }
+            emit sendImage(QImage(frame.data, w, h, frame.stride, QImage::Format_Grayscale8));
+        } else if (frame.channels == 3) {
+            if (methodName == "yolov5") {
+                detector->submit(frame);
+                /* boxes of the newest finished detection over the current frame */
+                DetectionStage::Result result;
+                if (detector->getLatest(result)) {
+                    cv::Mat img(h, w, CV_8UC3, frame.data, frame.stride);
+                    DetectionStage::draw(img, result);
+                }
             }
-            emit sendImage(QImage(data, w, h, QImage::Format_RGB888));
-        } else if (c == 4) {
-            emit sendImage(QImage(data, w, h, QImage::Format_ARGB32));
+            emit sendImage(QImage(frame.data, w, h, frame.stride, QImage::Format_RGB888));
+        } else if (frame.channels == 4) {
+            emit sendImage(QImage(frame.data, w, h, frame.stride, QImage::Format_ARGB32));
         }
 
     });
+    /* decode straight to the preview size, in the layout Imageprocess expects */
+    camera->setOutputFormat(Camera::Output_RGB24);
+    camera->setOutputSize(ui->cameralabel->width(), ui->cameralabel->height());
     camera->start(devices[0].path, CAMERA_PIXELFORMAT_JPEG, res[0]);
     connect(this, &MainWindow::sendImage,
             this, &MainWindow::updateImage, Qt::QueuedConnection);
@@ -79,6 +103,10 @@ MainWindow::~MainWindow()
         delete camera;
         camera = nullptr;
     }
+    if (detector != nullptr) {
+        delete detector;
+        detector = nullptr;
+    }
     delete ui;
 }
 
@@ -168,5 +196,17 @@ void MainWindow::closeEvent(QCloseEvent *ev)
     if (camera != nullptr) {
         camera->stop();
     }
+    if (detector != nullptr) {
+        detector->stop();
+    }
+    return;
+}
+
+void MainWindow::resizeEvent(QResizeEvent *ev)
+{
+    QMainWindow::resizeEvent(ev);
+    if (camera != nullptr) {
+        camera->setOutputSize(ui->cameralabel->width(), ui->cameralabel->height());
+    }
     return;
 }
@@ -3,9 +3,11 @@
 
 #include <QMainWindow>
 #include <QCloseEvent>
+#include <QResizeEvent>
 #include <QPixmap>
 #include "camera/camera.h"
 #include "imageprocess.h"
+#include "detectionstage.h"
 #include "settingdialog.h"
 
 namespace Ui {
@@ -29,9 +31,11 @@ public slots:
     void onResolutionChanged(const QString &res);
 protected:
     void closeEvent(QCloseEvent *ev) override;
+    void resizeEvent(QResizeEvent *ev) override;
 private:
     Ui::MainWindow *ui;
     Camera::Device *camera;
+    DetectionStage *detector;
     SettingDialog *dialog;
     QString methodName;
 };
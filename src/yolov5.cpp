@@ -1,5 +1,11 @@
 #include "yolov5.h"
 #include "ncnn/cpu.h"
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 Yolov5::Yolov5()
 {
@@ -17,14 +23,10 @@ Yolov5::Yolov5()
     target_size = 640;
     prob_threshold = 0.25f;
     nms_threshold = 0.45f;
-    /* memory pool */
-    blob_pool_allocator.set_size_compare_ratio(0.f);
-    workspace_pool_allocator.set_size_compare_ratio(0.f);
-    blob_pool_allocator.clear();
-    workspace_pool_allocator.clear();
-    yolov5.opt.blob_allocator = &blob_pool_allocator;
-    yolov5.opt.workspace_allocator = &workspace_pool_allocator;
-    /* optimization */
+    max_detections = 300;
+    top_k = 0;
+    agnostic_nms = false;
+    /* optimization, memory pools belong to each DetectContext */
     yolov5.opt.use_vulkan_compute = false;
     ncnn::set_cpu_powersave(2);
     ncnn::set_omp_num_threads(ncnn::get_big_cpu_count());
@@ -32,6 +34,23 @@ Yolov5::Yolov5()
     yolov5.opt.num_threads = ncnn::get_big_cpu_count();
 }
 
+Yolov5::DetectContext::DetectContext()
+    :srcWidth(0),srcHeight(0),srcTargetSize(0),resized_w(0),resized_h(0),
+      wpad(0),hpad(0),letterboxScale(1.f)
+{
+    /* memory pool */
+    blob_pool_allocator.set_size_compare_ratio(0.f);
+    workspace_pool_allocator.set_size_compare_ratio(0.f);
+    blob_pool_allocator.clear();
+    workspace_pool_allocator.clear();
+}
+
+Yolov5::DetectContext &Yolov5::threadContext()
+{
+    static thread_local DetectContext context;
+    return context;
+}
+
 bool Yolov5::load(const std::string &modelType)
 {
     if (modelType.empty()) {
@@ -53,120 +72,82 @@ bool Yolov5::load(const std::string &modelType)
 
 int Yolov5::detect(const cv::Mat &image, std::vector<Yolov5::Object> &objects)
 {
-    int img_w = image.cols;
-    int img_h = image.rows;
-
-    // letterbox pad to multiple of MAX_STRIDE
-    int w = img_w;
-    int h = img_h;
-    float scale = 1.f;
-    if (w > h) {
-        scale = (float)target_size / w;
-        w = target_size;
-        h = h * scale;
-    } else {
-        scale = (float)target_size / h;
-        h = target_size;
-        w = w * scale;
-    }
-
-    ncnn::Mat in = ncnn::Mat::from_pixels_resize(image.data,
-                                                 ncnn::Mat::PIXEL_RGB,
-                                                 img_w, img_h, w, h);
-
-    // pad to target_size rectangle
-    // yolov5/utils/datasets.py letterbox
-    int wpad = (w + MAX_STRIDE - 1) / MAX_STRIDE * MAX_STRIDE - w;
-    int hpad = (h + MAX_STRIDE - 1) / MAX_STRIDE * MAX_STRIDE - h;
-    ncnn::Mat in_pad;
-    ncnn::copy_make_border(in, in_pad,
-                           hpad / 2, hpad - hpad / 2,
-                           wpad / 2, wpad - wpad / 2,
-                           ncnn::BORDER_CONSTANT, 114.f);
-
-    //const float mean[3] = {0.485*255, 0.456*255, 0.406*255};
-    //const float std[3] = {1.f/(0.229*255), 1.f/(0.224*255), 1.f/(0.225*255)};
-    const float mean_vals[3] = {0, 0, 0};
-    const float norm_vals[3] = {1.f/255, 1.f/255, 1.f/255};
-    in_pad.substract_mean_normalize(mean_vals, norm_vals);
-    ncnn::Extractor ex = yolov5.create_extractor();
-
-    ex.input("images", in_pad);
-
-    std::vector<Object> proposals;
-
-    // anchor setting from yolov5/models/yolov5s.yaml
-
-    // stride 8
-    {
-        ncnn::Mat out;
-        ex.extract("output", out);
-
-        ncnn::Mat anchors(6);
-        anchors[0] = 10.f;
-        anchors[1] = 13.f;
-        anchors[2] = 16.f;
-        anchors[3] = 30.f;
-        anchors[4] = 33.f;
-        anchors[5] = 23.f;
+    return detect(threadContext(), image, objects);
+}
 
-        std::vector<Object> objects8;
-        generate_proposals(anchors, 8, in_pad, out, prob_threshold, objects8);
+int Yolov5::detect(Yolov5::DetectContext &context, const cv::Mat &image, std::vector<Yolov5::Object> &objects)
+{
+    return detect(context, image.data, image.cols, image.rows, image.step, PIXEL_RGB, objects);
+}
 
-        proposals.insert(proposals.end(), objects8.begin(), objects8.end());
+int Yolov5::detect(Yolov5::DetectContext &context, const unsigned char *data, int width, int height, int stride,
+                   int pixelType, std::vector<Yolov5::Object> &objects)
+{
+    if (data == nullptr || width < 1 || height < 1) {
+        return -1;
     }
-
-    // stride 16
+    int img_w = width;
+    int img_h = height;
+
+    // resize, pad and normalize in one pass into in_pad
+    letterbox(context, data, width, height, stride, pixelType);
+    const float scale = context.letterboxScale;
+    const int wpad = context.wpad;
+    const int hpad = context.hpad;
     {
-        ncnn::Mat out;
-#if YOLOV5_V60
-        ex.extract("376", out);
-#else
-        ex.extract("781", out);
-#endif
-
-        ncnn::Mat anchors(6);
-        anchors[0] = 30.f;
-        anchors[1] = 61.f;
-        anchors[2] = 62.f;
-        anchors[3] = 45.f;
-        anchors[4] = 59.f;
-        anchors[5] = 119.f;
+        ncnn::MutexLockGuard guard(filterLock);
+        context.classes = classFilter;
+    }
 
-        std::vector<Object> objects16;
-        generate_proposals(anchors, 16, in_pad, out, prob_threshold, objects16);
+    // extractors of one net run concurrently, each on the pools of its context
+    ncnn::Extractor ex = yolov5.create_extractor();
+    ex.set_blob_allocator(&context.blob_pool_allocator);
+    ex.set_workspace_allocator(&context.workspace_pool_allocator);
 
-        proposals.insert(proposals.end(), objects16.begin(), objects16.end());
-    }
+    ex.input("images", context.in_pad);
 
-    // stride 32
-    {
-        ncnn::Mat out;
+    // anchor setting from yolov5/models/yolov5s.yaml
+    static const float anchor_table[3][6] = {
+        {10.f, 13.f, 16.f, 30.f, 33.f, 23.f},
+        {30.f, 61.f, 62.f, 45.f, 59.f, 119.f},
+        {116.f, 90.f, 156.f, 198.f, 373.f, 326.f}
+    };
+    static const int strides[3] = {8, 16, 32};
 #if YOLOV5_V60
-        ex.extract("401", out);
+    static const char* blobs[3] = {"output", "376", "401"};
 #else
-        ex.extract("801", out);
+    static const char* blobs[3] = {"output", "781", "801"};
 #endif
-        ncnn::Mat anchors(6);
-        anchors[0] = 116.f;
-        anchors[1] = 90.f;
-        anchors[2] = 156.f;
-        anchors[3] = 198.f;
-        anchors[4] = 373.f;
-        anchors[5] = 326.f;
+    // the extractor is not reentrant, run the network first
+    ncnn::Mat outs[3];
+    ncnn::Mat anchors[3];
+    for (int k = 0; k < 3; k++) {
+        ex.extract(blobs[k], outs[k]);
+        anchors[k].create(6);
+        for (int i = 0; i < 6; i++) {
+            anchors[k][i] = anchor_table[k][i];
+        }
+    }
 
-        std::vector<Object> objects32;
-        generate_proposals(anchors, 32, in_pad, out, prob_threshold, objects32);
+    // decode the strides in parallel into storage kept across frames
+    #pragma omp parallel for num_threads(3)
+    for (int k = 0; k < 3; k++) {
+        generate_proposals(anchors[k], strides[k], context.in_pad, outs[k], prob_threshold,
+                           context.classes, context.strideProposals[k]);
+    }
 
-        proposals.insert(proposals.end(), objects32.begin(), objects32.end());
+    std::vector<Object>& proposals = context.proposals;
+    std::vector<int>& picked = context.picked;
+    proposals.clear();
+    for (int k = 0; k < 3; k++) {
+        proposals.insert(proposals.end(), context.strideProposals[k].begin(), context.strideProposals[k].end());
     }
 
     // sort all proposals by score from highest to lowest
-    qsort_descent_inplace(proposals);
+    sort_descent(proposals, top_k);
 
     // apply nms with nms_threshold
-    std::vector<int> picked;
-    nms_sorted_bboxes(proposals, picked, nms_threshold);
+    nms_sorted_bboxes(context, proposals, context.in_pad.w, context.in_pad.h, picked, nms_threshold);
 
     int count = picked.size();
 
@@ -200,9 +181,6 @@ void Yolov5::draw(cv::Mat &image, const std::vector<Yolov5::Object> &objects)
     for (size_t i = 0; i < objects.size(); i++) {
         const Yolov5::Object& obj = objects[i];
 
-        fprintf(stderr, "%d = %.5f at %.2f %.2f %.2f x %.2f\n", obj.label, obj.prob,
-                obj.rect.x, obj.rect.y, obj.rect.width, obj.rect.height);
-
         cv::rectangle(image, obj.rect, cv::Scalar(0, 255, 0), 2);
 
         char text[256];
@@ -229,52 +207,327 @@ void Yolov5::draw(cv::Mat &image, const std::vector<Yolov5::Object> &objects)
     return;
 }
 
-void Yolov5::qsort_descent_inplace(std::vector<Object>& objects, int left, int right)
+template<int pixelType>
+static inline void load_rgb(const unsigned char* row, const unsigned char* uv, int x, float* rgb)
+{
+    if (pixelType == Yolov5::PIXEL_RGB) {
+        rgb[0] = row[3 * x];
+        rgb[1] = row[3 * x + 1];
+        rgb[2] = row[3 * x + 2];
+    } else if (pixelType == Yolov5::PIXEL_BGR) {
+        rgb[0] = row[3 * x + 2];
+        rgb[1] = row[3 * x + 1];
+        rgb[2] = row[3 * x];
+    } else if (pixelType == Yolov5::PIXEL_NV12) {
+        // JFIF full range BT.601, as the jpeg decoder emits it
+        float y = row[x];
+        float u = uv[x & ~1] - 128.f;
+        float v = uv[(x & ~1) + 1] - 128.f;
+        rgb[0] = std::max(std::min(y + 1.402f * v, 255.f), 0.f);
+        rgb[1] = std::max(std::min(y - 0.344136f * u - 0.714136f * v, 255.f), 0.f);
+        rgb[2] = std::max(std::min(y + 1.772f * u, 255.f), 0.f);
+    } else {
+        // video range BT.601, as YUYV cameras emit it
+        float y = 1.164383f * (row[x] - 16.f);
+        float u = uv[x & ~1] - 128.f;
+        float v = uv[(x & ~1) + 1] - 128.f;
+        rgb[0] = std::max(std::min(y + 1.596027f * v, 255.f), 0.f);
+        rgb[1] = std::max(std::min(y - 0.391762f * u - 0.812968f * v, 255.f), 0.f);
+        rgb[2] = std::max(std::min(y + 2.017232f * u, 255.f), 0.f);
+    }
+    return;
+}
+
+// one source row horizontally resized to w pixels of interleaved R,G,B
+template<int pixelType>
+static void resize_row(const unsigned char* data, int stride, int height, int sy,
+                       const int* xofs, const float* xalpha, int w, float* out)
+{
+    const unsigned char* row = data + (std::size_t)sy * stride;
+    const unsigned char* uv = data + (std::size_t)height * stride + (std::size_t)(sy / 2) * stride;
+    for (int x = 0; x < w; x++) {
+        float a[3];
+        float b[3];
+        load_rgb<pixelType>(row, uv, xofs[2 * x], a);
+        load_rgb<pixelType>(row, uv, xofs[2 * x + 1], b);
+        const float alpha = xalpha[x];
+        out[3 * x] = a[0] + (b[0] - a[0]) * alpha;
+        out[3 * x + 1] = a[1] + (b[1] - a[1]) * alpha;
+        out[3 * x + 2] = a[2] + (b[2] - a[2]) * alpha;
+    }
+    return;
+}
+
+void Yolov5::letterbox(Yolov5::DetectContext &context, const unsigned char *data, int width, int height,
+                       int stride, int pixelType)
 {
-    int i = left;
-    int j = right;
-    float p = objects[(left + right) / 2].prob;
-
-    while (i <= j) {
-        while (objects[i].prob > p)
-            i++;
-
-        while (objects[j].prob < p)
-            j--;
-
-        if (i <= j) {
-            // swap
-            std::swap(objects[i], objects[j]);
-            i++;
-            j--;
+    if (width != context.srcWidth || height != context.srcHeight || target_size != context.srcTargetSize) {
+        // letterbox pad to multiple of MAX_STRIDE
+        int w = width;
+        int h = height;
+        float scale = 1.f;
+        if (w > h) {
+            scale = (float)target_size / w;
+            w = target_size;
+            h = h * scale;
+        } else {
+            scale = (float)target_size / h;
+            h = target_size;
+            w = w * scale;
+        }
+        w = std::max(w, 1);
+        h = std::max(h, 1);
+        // pad to target_size rectangle
+        // yolov5/utils/datasets.py letterbox
+        context.wpad = (w + MAX_STRIDE - 1) / MAX_STRIDE * MAX_STRIDE - w;
+        context.hpad = (h + MAX_STRIDE - 1) / MAX_STRIDE * MAX_STRIDE - h;
+        context.resized_w = w;
+        context.resized_h = h;
+        context.letterboxScale = scale;
+        context.in_pad.create(w + context.wpad, h + context.hpad, 3);
+
+        // bilinear taps with the pixel centre mapping of ncnn::resize_bilinear
+        const float scale_x = (float)width / w;
+        context.xofs.resize(2 * w);
+        context.xalpha.resize(w);
+        for (int x = 0; x < w; x++) {
+            float fx = (x + 0.5f) * scale_x - 0.5f;
+            int sx = (int)floor(fx);
+            fx -= sx;
+            if (sx < 0) {
+                sx = 0;
+                fx = 0.f;
+            }
+            if (sx >= width - 1) {
+                sx = width - 1;
+                fx = 0.f;
+            }
+            context.xofs[2 * x] = sx;
+            context.xofs[2 * x + 1] = std::min(sx + 1, width - 1);
+            context.xalpha[x] = fx;
         }
+        context.resizeRows.resize(2 * 3 * w);
+        context.srcWidth = width;
+        context.srcHeight = height;
+        context.srcTargetSize = target_size;
     }
 
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            if (left < j) qsort_descent_inplace(objects, left, j);
+    typedef void (*FnResizeRow)(const unsigned char*, int, int, int, const int*, const float*, int, float*);
+    FnResizeRow resizeRow = resize_row<PIXEL_RGB>;
+    if (pixelType == PIXEL_BGR) {
+        resizeRow = resize_row<PIXEL_BGR>;
+    } else if (pixelType == PIXEL_NV12) {
+        resizeRow = resize_row<PIXEL_NV12>;
+    } else if (pixelType == PIXEL_NV12_VIDEO) {
+        resizeRow = resize_row<PIXEL_NV12_VIDEO>;
+    }
+
+    ncnn::Mat& in_pad = context.in_pad;
+    const int w = context.resized_w;
+    const int h = context.resized_h;
+    const int top = context.hpad / 2;
+    const int left = context.wpad / 2;
+    const int right = context.wpad - left;
+    const float norm = 1.f / 255;
+    const float pad_value = 114.f * norm;
+    const float scale_y = (float)height / h;
+
+    float* rows[2] = {context.resizeRows.data(), context.resizeRows.data() + 3 * w};
+    int cached[2] = {-1, -1};
+
+    for (int y = 0; y < in_pad.h; y++) {
+        float* outptr[3] = {in_pad.channel(0).row(y), in_pad.channel(1).row(y), in_pad.channel(2).row(y)};
+        int dy = y - top;
+        if (dy < 0 || dy >= h) {
+            for (int c = 0; c < 3; c++) {
+                std::fill(outptr[c], outptr[c] + in_pad.w, pad_value);
+            }
+            continue;
         }
-        #pragma omp section
-        {
-            if (i < right) qsort_descent_inplace(objects, i, right);
+
+        float fy = (dy + 0.5f) * scale_y - 0.5f;
+        int sy = (int)floor(fy);
+        fy -= sy;
+        if (sy < 0) {
+            sy = 0;
+            fy = 0.f;
+        }
+        if (sy >= height - 1) {
+            sy = height - 1;
+            fy = 0.f;
+        }
+        int sy1 = std::min(sy + 1, height - 1);
+
+        // consecutive output rows mostly share their source rows
+        if (cached[1] == sy) {
+            std::swap(rows[0], rows[1]);
+            std::swap(cached[0], cached[1]);
+        }
+        if (cached[0] != sy) {
+            resizeRow(data, stride, height, sy, context.xofs.data(), context.xalpha.data(), w, rows[0]);
+            cached[0] = sy;
+        }
+        if (cached[1] != sy1) {
+            resizeRow(data, stride, height, sy1, context.xofs.data(), context.xalpha.data(), w, rows[1]);
+            cached[1] = sy1;
+        }
+
+        // blend the two rows, split R,G,B into planes and normalize
+        const float b1 = fy * norm;
+        const float b0 = norm - b1;
+        const float* r0 = rows[0];
+        const float* r1 = rows[1];
+        for (int c = 0; c < 3; c++) {
+            float* ptr = outptr[c];
+            std::fill(ptr, ptr + left, pad_value);
+            ptr += left;
+            for (int x = 0; x < w; x++) {
+                ptr[x] = r0[3 * x + c] * b0 + r1[3 * x + c] * b1;
+            }
+            std::fill(ptr + w, ptr + w + right, pad_value);
         }
     }
     return;
 }
 
-void Yolov5::qsort_descent_inplace(std::vector<Object>& objects)
+static inline bool higher_score(const Yolov5::Object& a, const Yolov5::Object& b)
 {
-    if (objects.empty()) {
-        return;
+    return a.prob > b.prob;
+}
+
+void Yolov5::sort_descent(std::vector<Object>& objects, int top_k)
+{
+    if (top_k > 0 && (int)objects.size() > top_k) {
+        // only the best top_k need an order, the rest is dropped
+        std::partial_sort(objects.begin(), objects.begin() + top_k, objects.end(), higher_score);
+        objects.resize(top_k);
+    } else {
+        // introsort
+        std::sort(objects.begin(), objects.end(), higher_score);
     }
-    qsort_descent_inplace(objects, 0, objects.size() - 1);
     return;
 }
 
-void Yolov5::generate_proposals(const ncnn::Mat &anchors, int stride, const ncnn::Mat &in_pad, const ncnn::Mat &feat_blob, float prob_threshold, std::vector<Yolov5::Object> &objects)
+int Yolov5::argmax_scalar(const float *x, int n, float &maxValue)
+{
+    int index = 0;
+    maxValue = -FLT_MAX;
+    for (int k = 0; k < n; k++) {
+        if (x[k] > maxValue) {
+            index = k;
+            maxValue = x[k];
+        }
+    }
+    return index;
+}
+
+/* the vector pass only finds the maximum, its first position is then a short scalar scan */
+static inline int first_of(const float *x, int n, float maxValue)
+{
+    for (int k = 0; k < n; k++) {
+        if (x[k] == maxValue) {
+            return k;
+        }
+    }
+    return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+int Yolov5::argmax_sse2(const float *x, int n, float &maxValue)
+{
+    if (n < 4) {
+        return argmax_scalar(x, n, maxValue);
+    }
+    __m128 m = _mm_loadu_ps(x);
+    int k = 4;
+    for (; k + 4 <= n; k += 4) {
+        m = _mm_max_ps(m, _mm_loadu_ps(x + k));
+    }
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    maxValue = _mm_cvtss_f32(m);
+    for (; k < n; k++) {
+        maxValue = x[k] > maxValue ? x[k] : maxValue;
+    }
+    return first_of(x, n, maxValue);
+}
+
+__attribute__((target("avx2")))
+int Yolov5::argmax_avx2(const float *x, int n, float &maxValue)
+{
+    if (n < 8) {
+        return argmax_scalar(x, n, maxValue);
+    }
+    __m256 m = _mm256_loadu_ps(x);
+    int k = 8;
+    for (; k + 8 <= n; k += 8) {
+        m = _mm256_max_ps(m, _mm256_loadu_ps(x + k));
+    }
+    __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    h = _mm_max_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(1, 0, 3, 2)));
+    h = _mm_max_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(2, 3, 0, 1)));
+    maxValue = _mm_cvtss_f32(h);
+    for (; k < n; k++) {
+        maxValue = x[k] > maxValue ? x[k] : maxValue;
+    }
+    return first_of(x, n, maxValue);
+}
+#endif
+
+#if defined(__aarch64__)
+int Yolov5::argmax_neon(const float *x, int n, float &maxValue)
+{
+    if (n < 4) {
+        return argmax_scalar(x, n, maxValue);
+    }
+    float32x4_t m = vld1q_f32(x);
+    int k = 4;
+    for (; k + 4 <= n; k += 4) {
+        m = vmaxq_f32(m, vld1q_f32(x + k));
+    }
+    maxValue = vmaxvq_f32(m);
+    for (; k < n; k++) {
+        maxValue = x[k] > maxValue ? x[k] : maxValue;
+    }
+    return first_of(x, n, maxValue);
+}
+#endif
+
+Yolov5::FnArgmax Yolov5::selectArgmax()
 {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return argmax_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return argmax_sse2;
+    }
+#elif defined(__aarch64__)
+    return argmax_neon;
+#endif
+    return argmax_scalar;
+}
+
+const Yolov5::FnArgmax Yolov5::argmax = Yolov5::selectArgmax();
+
+void Yolov5::setClassFilter(const std::vector<int> &classes)
+{
+    ncnn::MutexLockGuard guard(filterLock);
+    classFilter.clear();
+    for (std::size_t i = 0; i < classes.size(); i++) {
+        if (classes[i] >= 0 && classes[i] < (int)labels.size()) {
+            classFilter.push_back(classes[i]);
+        }
+    }
+    return;
+}
+
+void Yolov5::generate_proposals(const ncnn::Mat &anchors, int stride, const ncnn::Mat &in_pad, const ncnn::Mat &feat_blob, float prob_threshold, const std::vector<int> &classes, std::vector<Yolov5::Object> &objects)
+{
+    objects.clear();
+
     const int num_grid = feat_blob.h;
 
     int num_grid_x;
@@ -291,6 +544,10 @@ void Yolov5::generate_proposals(const ncnn::Mat &anchors, int stride, const ncnn
 
     const int num_anchors = anchors.w / 2;
 
+    // sigmoid(box) * sigmoid(class) < sigmoid(box): a cell whose objectness alone
+    // misses the threshold never needs its class scores
+    const float box_threshold = logit(prob_threshold);
+
     for (int q = 0; q < num_anchors; q++) {
         const float anchor_w = anchors[q * 2];
         const float anchor_h = anchors[q * 2 + 1];
@@ -301,19 +558,26 @@ void Yolov5::generate_proposals(const ncnn::Mat &anchors, int stride, const ncnn
             for (int j = 0; j < num_grid_x; j++) {
                 const float* featptr = feat.row(i * num_grid_x + j);
 
+                float box_score = featptr[4];
+                if (box_score < box_threshold) {
+                    continue;
+                }
+
                 // find class index with max class score
                 int class_index = 0;
                 float class_score = -FLT_MAX;
-                for (int k = 0; k < num_class; k++) {
-                    float score = featptr[5 + k];
-                    if (score > class_score) {
-                        class_index = k;
-                        class_score = score;
+                if (classes.empty()) {
+                    class_index = argmax(featptr + 5, num_class, class_score);
+                } else {
+                    for (std::size_t k = 0; k < classes.size(); k++) {
+                        int c = classes[k];
+                        if (c < num_class && featptr[5 + c] > class_score) {
+                            class_index = c;
+                            class_score = featptr[5 + c];
+                        }
                     }
                 }
 
-                float box_score = featptr[4];
-
                 float confidence = sigmoid(box_score) * sigmoid(class_score);
 
                 if (confidence >= prob_threshold) {
@@ -324,14 +588,14 @@ void Yolov5::generate_proposals(const ncnn::Mat &anchors, int stride, const ncnn
 
                     float dx = sigmoid(featptr[0]);
                     float dy = sigmoid(featptr[1]);
-                    float dw = sigmoid(featptr[2]);
-                    float dh = sigmoid(featptr[3]);
+                    float dw = sigmoid(featptr[2]) * 2.f;
+                    float dh = sigmoid(featptr[3]) * 2.f;
 
                     float pb_cx = (dx * 2.f - 0.5f + j) * stride;
                     float pb_cy = (dy * 2.f - 0.5f + i) * stride;
 
-                    float pb_w = pow(dw * 2.f, 2) * anchor_w;
-                    float pb_h = pow(dh * 2.f, 2) * anchor_h;
+                    float pb_w = dw * dw * anchor_w;
+                    float pb_h = dh * dh * anchor_h;
 
                     float x0 = pb_cx - pb_w * 0.5f;
                     float y0 = pb_cy - pb_h * 0.5f;
@@ -354,34 +618,82 @@ void Yolov5::generate_proposals(const ncnn::Mat &anchors, int stride, const ncnn
     return;
 }
 
-void Yolov5::nms_sorted_bboxes(const std::vector<Yolov5::Object> &objects, std::vector<int> &picked, float nms_threshold)
+void Yolov5::nms_sorted_bboxes(Yolov5::DetectContext &context, const std::vector<Yolov5::Object> &objects, int width, int height, std::vector<int> &picked, float nms_threshold)
 {
     picked.clear();
 
     const int n = objects.size();
+    if (n == 0) {
+        return;
+    }
 
-    std::vector<float> areas(n);
+    std::vector<float>& areas = context.areas;
+    std::vector<int>& visited = context.visited;
+    std::vector<std::vector<int> >& gridCells = context.gridCells;
+    areas.resize(n);
     for (int i = 0; i < n; i++) {
         areas[i] = objects[i].rect.area();
     }
 
+    // kept boxes are registered in every cell of a coarse grid they cover,
+    // two boxes can only overlap when they share a cell
+    const float cell_w = std::max(1.f, (float)width / NMS_GRID);
+    const float cell_h = std::max(1.f, (float)height / NMS_GRID);
+    gridCells.resize(NMS_GRID * NMS_GRID);
+    for (std::size_t c = 0; c < gridCells.size(); c++) {
+        gridCells[c].clear();
+    }
+    // last candidate a kept box was compared with, a box spans several cells
+    visited.assign(n, -1);
+
     for (int i = 0; i < n; i++) {
         const Object& a = objects[i];
 
+        int gx0 = std::max(std::min((int)(a.rect.x / cell_w), NMS_GRID - 1), 0);
+        int gy0 = std::max(std::min((int)(a.rect.y / cell_h), NMS_GRID - 1), 0);
+        int gx1 = std::max(std::min((int)((a.rect.x + a.rect.width) / cell_w), NMS_GRID - 1), 0);
+        int gy1 = std::max(std::min((int)((a.rect.y + a.rect.height) / cell_h), NMS_GRID - 1), 0);
+
         int keep = 1;
-        for (int j = 0; j < (int)picked.size(); j++) {
-            const Object& b = objects[picked[j]];
-
-            // intersection over union
-            float inter_area = intersection_area(a, b);
-            float union_area = areas[i] + areas[picked[j]] - inter_area;
-            // float IoU = inter_area / union_area
-            if (inter_area / union_area > nms_threshold)
-                keep = 0;
+        for (int gy = gy0; gy <= gy1 && keep; gy++) {
+            for (int gx = gx0; gx <= gx1 && keep; gx++) {
+                const std::vector<int>& cell = gridCells[gy * NMS_GRID + gx];
+                for (std::size_t k = 0; k < cell.size(); k++) {
+                    int j = cell[k];
+                    if (visited[j] == i) {
+                        continue;
+                    }
+                    visited[j] = i;
+                    const Object& b = objects[j];
+                    if (!agnostic_nms && b.label != a.label) {
+                        continue;
+                    }
+
+                    // intersection over union
+                    float inter_area = intersection_area(a, b);
+                    float union_area = areas[i] + areas[j] - inter_area;
+                    // float IoU = inter_area / union_area
+                    if (inter_area / union_area > nms_threshold) {
+                        keep = 0;
+                        break;
+                    }
+                }
+            }
         }
 
-        if (keep)
-            picked.push_back(i);
+        if (!keep) {
+            continue;
+        }
+        picked.push_back(i);
+        // proposals are sorted, the first max_detections kept are the best
+        if (max_detections > 0 && (int)picked.size() >= max_detections) {
+            break;
+        }
+        for (int gy = gy0; gy <= gy1; gy++) {
+            for (int gx = gx0; gx <= gx1; gx++) {
+                gridCells[gy * NMS_GRID + gx].push_back(i);
+            }
+        }
     }
     return;
 }
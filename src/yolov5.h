@@ -17,6 +17,7 @@
 #include <string>
 #define YOLOV5_V60 1 //YOLOv5 v6.0
 #define MAX_STRIDE 64
+#define NMS_GRID 16
 
 // original pretrained model from https://github.com/ultralytics/yolov5
 // the ncnn model https://github.com/nihui/ncnn-assets/tree/master/models
@@ -28,48 +29,133 @@ public:
         int label;
         float prob;
     };
+    /* sources detect() reads without converting first */
+    enum PixelType {
+        PIXEL_RGB = 0,
+        PIXEL_BGR,
+        PIXEL_NV12,         /* full range, UV plane follows height rows of stride */
+        PIXEL_NV12_VIDEO    /* same layout, video range */
+    };
+    /*
+        everything one detect() call writes: the allocators of its extractor,
+        the network input and the proposal and nms scratch.
+        one context per detecting thread, capacity is kept across frames.
+    */
+    class DetectContext
+    {
+    public:
+        ncnn::UnlockedPoolAllocator blob_pool_allocator;
+        ncnn::PoolAllocator workspace_pool_allocator;
+        /* copy of the class filter taken at the start of detect() */
+        std::vector<int> classes;
+        /* proposals of stride 8, 16, 32 */
+        std::vector<Object> strideProposals[3];
+        /* nms scratch */
+        std::vector<Object> proposals;
+        std::vector<int> picked;
+        std::vector<float> areas;
+        std::vector<int> visited;
+        std::vector<std::vector<int> > gridCells;
+        /* network input and resize tables, rebuilt when the source size changes */
+        ncnn::Mat in_pad;
+        int srcWidth;
+        int srcHeight;
+        int srcTargetSize;
+        int resized_w;
+        int resized_h;
+        int wpad;
+        int hpad;
+        float letterboxScale;
+        std::vector<int> xofs;
+        std::vector<float> xalpha;
+        std::vector<float> resizeRows;
+    public:
+        DetectContext();
+        DetectContext(const DetectContext &r) = delete;
+        DetectContext& operator=(const DetectContext &r) = delete;
+    };
 public:
+    /* settings, change them before detecting */
     std::vector<std::string> labels;
-    ncnn::Mutex lock;
     int target_size;
     float prob_threshold;
     float nms_threshold;
+    /* detections kept by nms, 0: no cap */
+    int max_detections;
+    /* only the top_k proposals by score enter nms, 0: all */
+    int top_k;
+    /* suppress overlapping boxes of different labels too */
+    bool agnostic_nms;
 private:
+    /* loaded once, only read by the extractors of every context */
     ncnn::Net yolov5;
-    ncnn::UnlockedPoolAllocator blob_pool_allocator;
-    ncnn::PoolAllocator workspace_pool_allocator;
+    ncnn::Mutex filterLock;
+    /* classes reported by detect(), empty: all */
+    std::vector<int> classFilter;
 public:
     static Yolov5& instance()
     {
         static Yolov5 yolov5;
         return yolov5;
     }
+    /* not while detecting */
     bool load(const std::string &modelType);
-    int detect(const cv::Mat& bgr, std::vector<Object>& objects);
+    /* safe on several threads at once, each with its own context */
+    int detect(DetectContext &context, const unsigned char* data, int width, int height, int stride,
+               int pixelType, std::vector<Object>& objects);
+    int detect(DetectContext &context, const cv::Mat& rgb, std::vector<Object>& objects);
+    /* with the context of the calling thread */
+    int detect(const cv::Mat& rgb, std::vector<Object>& objects);
+    static DetectContext& threadContext();
     void draw(cv::Mat &bgr, const std::vector<Object>& objects);
+    /* only score these labels, the others are skipped during decoding */
+    void setClassFilter(const std::vector<int> &classes);
+private:
+    using FnArgmax = int (*)(const float* x, int n, float &maxValue);
+    /* chosen once from the cpu features */
+    static const FnArgmax argmax;
+    static FnArgmax selectArgmax();
+    static int argmax_scalar(const float* x, int n, float &maxValue);
+#if defined(__x86_64__) || defined(__i386__)
+    static int argmax_sse2(const float* x, int n, float &maxValue);
+    static int argmax_avx2(const float* x, int n, float &maxValue);
+#elif defined(__aarch64__)
+    static int argmax_neon(const float* x, int n, float &maxValue);
+#endif
 private:
     static inline float sigmoid(float x)
     {
         return static_cast<float>(1.f / (1.f + exp(-x)));
     }
+    /* inverse of sigmoid */
+    static inline float logit(float p)
+    {
+        return static_cast<float>(-log(1.f / p - 1.f));
+    }
     static inline float intersection_area(const Object& a, const Object& b)
     {
         cv::Rect_<float> inter = a.rect & b.rect;
         return inter.area();
     }
-    static void qsort_descent_inplace(std::vector<Object>& objects, int left, int right);
-    static void qsort_descent_inplace(std::vector<Object>& objects);
+    void letterbox(DetectContext &context, const unsigned char* data, int width, int height,
+                   int stride, int pixelType);
+    static void sort_descent(std::vector<Object>& objects, int top_k);
     static void generate_proposals(const ncnn::Mat& anchors,
                                    int stride,
                                    const ncnn::Mat& in_pad,
                                    const ncnn::Mat& feat_blob,
                                    float prob_threshold,
+                                   const std::vector<int>& classes,
                                    std::vector<Object>& objects);
-    static void nms_sorted_bboxes(const std::vector<Object>& objects,
-                                  std::vector<int>& picked,
-                                  float nms_threshold);
+    void nms_sorted_bboxes(DetectContext &context,
+                           const std::vector<Object>& objects,
+                           int width, int height,
+                           std::vector<int>& picked,
+                           float nms_threshold);
 private:
     Yolov5();
+    /* test/test_yolov5.cpp checks the kernels against reference versions */
+    friend class Yolov5Test;
 };
 
 #endif // YOLOV5_H
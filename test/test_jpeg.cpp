@@ -0,0 +1,58 @@
+#include <camera/jpegwrap.h>
+#include <cstdio>
+#include <vector>
+#include "testutil.h"
+
+void test_validate()
+{
+    const int w = 64;
+    const int h = 48;
+    std::vector<uint8_t> frame = encodeFrame(w, h);
+    check(!frame.empty(), "encode");
+    if (frame.empty()) {
+        return;
+    }
+    check(Jpeg::validate(frame.data(), frame.size()) == Jpeg::CHECK_OK, "complete frame");
+    check(Jpeg::validate(frame.data(), frame.size(), w, h) == Jpeg::CHECK_OK, "complete frame, expected size");
+    check(Jpeg::validate(frame.data(), frame.size(), w*2, h) == Jpeg::CHECK_DIMENSION, "size mismatch");
+    /* padding after EOI */
+    std::vector<uint8_t> padded(frame);
+    padded.resize(frame.size() + 256, 0);
+    check(Jpeg::validate(padded.data(), padded.size(), w, h) == Jpeg::CHECK_OK, "zero padded frame");
+    /* truncated in the entropy coded data and in the headers */
+    check(Jpeg::validate(frame.data(), frame.size()/2, w, h) == Jpeg::CHECK_EOI, "truncated scan");
+    check(Jpeg::validate(frame.data(), frame.size() - 1, w, h) == Jpeg::CHECK_EOI, "missing last byte");
+    check(Jpeg::validate(frame.data(), 3) == Jpeg::CHECK_TRUNCATED, "shorter than a marker");
+    check(Jpeg::validate(nullptr, frame.size()) == Jpeg::CHECK_TRUNCATED, "no data");
+    /* SOI and the 18 byte APP0 of libjpeg, then EOI */
+    std::vector<uint8_t> headers(frame.begin(), frame.begin() + 20);
+    headers.push_back(0xFF);
+    headers.push_back(0xD9);
+    check(Jpeg::validate(headers.data(), headers.size()) == Jpeg::CHECK_TRUNCATED, "no scan before EOI");
+    headers.assign(frame.begin(), frame.begin() + 30);
+    headers.push_back(0xFF);
+    headers.push_back(0xD9);
+    check(Jpeg::validate(headers.data(), headers.size()) == Jpeg::CHECK_SEGMENT, "segment cut by EOI");
+    /* corrupt, the first segment follows SOI */
+    const std::size_t segment = 2;
+    std::vector<uint8_t> corrupt(frame);
+    corrupt[1] = 0x00;
+    check(Jpeg::validate(corrupt.data(), corrupt.size()) == Jpeg::CHECK_SOI, "bad SOI");
+    corrupt = frame;
+    corrupt[segment] = 0x00;
+    check(Jpeg::validate(corrupt.data(), corrupt.size()) == Jpeg::CHECK_SEGMENT, "bad marker prefix");
+    corrupt = frame;
+    corrupt[segment + 2] = 0xFF;
+    corrupt[segment + 3] = 0xFF;
+    check(Jpeg::validate(corrupt.data(), corrupt.size()) == Jpeg::CHECK_SEGMENT, "segment length past the end");
+    corrupt = frame;
+    corrupt[segment + 1] = 0xD9;
+    check(Jpeg::validate(corrupt.data(), corrupt.size()) == Jpeg::CHECK_SEGMENT, "EOI before the scan");
+    return;
+}
+
+int main()
+{
+    test_validate();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+#include <camera/restartdecoder.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "testutil.h"
+
+/* parse() and split() of one frame */
+class RestartProbe : public Camera::RestartDecoder
+{
+public:
+    explicit RestartProbe(int threadCount_):RestartDecoder(threadCount_){}
+    const Layout& getLayout() const {return layout;}
+    bool splitBands(const std::vector<uint8_t> &jpeg, std::vector<Band> &out)
+    {
+        return parse(jpeg.data(), jpeg.size(), layout) == 0 && split(jpeg.data(), out);
+    }
+};
+
+static bool samePlanes(const Jpeg::Planar &a, const Jpeg::Planar &b, int rowY, int rowUV)
+{
+    if (a.width != b.width || a.subsample != b.subsample) {
+        return false;
+    }
+    int chromaWidth = a.subsample == Jpeg::SUBSAMPLE_444 ? a.width : (a.width + 1)/2;
+    int chromaHeight = a.subsample == Jpeg::SUBSAMPLE_420 ? (b.height + 1)/2 : b.height;
+    for (int y = 0; y < b.height; y++) {
+        if (memcmp(a.y + std::size_t(rowY + y)*a.strideY, b.y + std::size_t(y)*b.strideY, a.width) != 0) {
+            return false;
+        }
+    }
+    for (int y = 0; y < chromaHeight; y++) {
+        if (memcmp(a.u + std::size_t(rowUV + y)*a.strideUV, b.u + std::size_t(y)*b.strideUV, chromaWidth) != 0 ||
+                memcmp(a.v + std::size_t(rowUV + y)*a.strideUV, b.v + std::size_t(y)*b.strideUV, chromaWidth) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_split()
+{
+    std::vector<uint8_t> frame = encodeFrame(640, 480, 1, 0, 2, 2);
+    RestartProbe probe(4);
+    std::vector<Camera::RestartDecoder::Band> bands;
+    check(probe.splitBands(frame, bands) && bands.size() == 4, "one restart interval per MCU row, 4 bands");
+    if (bands.size() != 4) {
+        return;
+    }
+    const Camera::RestartDecoder::Layout &layout = probe.getLayout();
+    Jpeg::Decompressor decompressor;
+    Jpeg::Planar full;
+    check(decompressor.decodeYUV(full, frame.data(), frame.size()) == 0, "serial decode");
+    /* copy the planes, the next decode reuses them */
+    std::vector<uint8_t> planes(full.y, full.y + std::size_t(full.strideY)*full.height);
+    std::vector<uint8_t> u(full.u, full.u + std::size_t(full.strideUV)*((full.height + 1)/2));
+    std::vector<uint8_t> v(full.v, full.v + std::size_t(full.strideUV)*((full.height + 1)/2));
+    full.y = planes.data();
+    full.u = u.data();
+    full.v = v.data();
+    int mcuRows = (layout.height + layout.mcuHeight - 1)/layout.mcuHeight;
+    int nextRow = 0;
+    bool contiguous = true;
+    bool standalone = true;
+    bool renumbered = true;
+    bool decoded = true;
+    for (std::size_t i = 0; i < bands.size(); i++) {
+        const Camera::RestartDecoder::Band &band = bands[i];
+        int endRow = i + 1 < bands.size() ? bands[i + 1].row : mcuRows;
+        int height = std::min(layout.height, endRow*layout.mcuHeight) - band.row*layout.mcuHeight;
+        contiguous = contiguous && band.row == nextRow && endRow > band.row;
+        nextRow = endRow;
+        /* a complete JPEG of the band rows */
+        standalone = standalone &&
+                Jpeg::validate(band.jpeg.data(), band.jpeg.size(), layout.width, height) == Jpeg::CHECK_OK;
+        /* RST0, RST1, ... from the start of every band, one less than its intervals */
+        int expected = 0;
+        for (std::size_t p = layout.scanOffset; p + 3 < band.jpeg.size(); p++) {
+            if (band.jpeg[p] == 0xFF && band.jpeg[p + 1] >= 0xD0 && band.jpeg[p + 1] <= 0xD7) {
+                renumbered = renumbered && band.jpeg[p + 1] == 0xD0 + (expected & 7);
+                expected++;
+            }
+        }
+        renumbered = renumbered && expected == endRow - band.row - 1;
+        Jpeg::Planar part;
+        decoded = decoded && decompressor.decodeYUV(part, (uint8_t*)band.jpeg.data(), band.jpeg.size()) == 0 &&
+                part.height == height &&
+                samePlanes(full, part, band.row*layout.mcuHeight, band.row*layout.mcuHeight/2);
+    }
+    check(contiguous && nextRow == mcuRows, "bands cover every MCU row once");
+    check(standalone, "bands are complete JPEGs with their own height");
+    check(renumbered, "restart markers renumbered from RST0");
+    check(decoded, "bands decode to the rows of the serial decode");
+    /* no DRI: nothing to split */
+    frame = encodeFrame(640, 480);
+    check(!probe.splitBands(frame, bands), "no restart markers");
+    return;
+}
+
+void test_decode()
+{
+    struct Case {
+        int w;
+        int h;
+        int restartRows;
+        int restartInterval;
+        int hSampling;
+        int vSampling;
+        const char* name;
+    };
+    const Case cases[] = {
+        {640, 480, 1, 0, 2, 2, "4:2:0, one MCU row per interval"},
+        {1920, 1080, 0, 3, 2, 2, "4:2:0, intervals across MCU rows"},
+        {1918, 1078, 0, 7, 2, 1, "4:2:2, odd size"},
+        {800, 600, 2, 0, 1, 1, "4:4:4, two MCU rows per interval"}
+    };
+    Camera::RestartDecoder restartDecoder(4);
+    Jpeg::Decompressor decompressor;
+    for (const Case &c : cases) {
+        std::vector<uint8_t> frame = encodeFrame(c.w, c.h, c.restartRows, c.restartInterval, c.hSampling, c.vSampling);
+        bool equal = true;
+        for (int scale = Jpeg::SCALE_D1; scale <= Jpeg::SCALE_D8; scale *= 2) {
+            Jpeg::Planar parallel;
+            std::vector<uint8_t> buffer;
+            int ret = restartDecoder.decodeYUV(decompressor, parallel, buffer, frame.data(), frame.size(), scale);
+            Jpeg::Planar serial;
+            equal = equal && ret == 0 &&
+                    decompressor.decodeYUV(serial, frame.data(), frame.size(), scale) == 0 &&
+                    serial.height == parallel.height && samePlanes(serial, parallel, 0, 0);
+        }
+        check(equal, c.name);
+    }
+    /* a serial decode is requested when there is nothing to split */
+    std::vector<uint8_t> frame = encodeFrame(640, 480);
+    Jpeg::Planar yuv;
+    std::vector<uint8_t> buffer;
+    check(restartDecoder.decodeYUV(decompressor, yuv, buffer, frame.data(), frame.size()) == 1, "serial fallback");
+    return;
+}
+
+int main()
+{
+    test_split();
+    test_decode();
+    return failures == 0 ? 0 : 1;
+}
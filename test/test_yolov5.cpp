@@ -0,0 +1,175 @@
+#include "src/yolov5.h"
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "testutil.h"
+
+class Yolov5Test
+{
+public:
+    using FnArgmax = Yolov5::FnArgmax;
+    /* every kernel this cpu can run, the scalar one first */
+    static std::vector<FnArgmax> argmaxKernels()
+    {
+        std::vector<FnArgmax> kernels(1, Yolov5::argmax_scalar);
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) {
+            kernels.push_back(Yolov5::argmax_sse2);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back(Yolov5::argmax_avx2);
+        }
+#elif defined(__aarch64__)
+        kernels.push_back(Yolov5::argmax_neon);
+#endif
+        kernels.push_back(Yolov5::argmax);
+        return kernels;
+    }
+    static void nms(Yolov5 &yolov5, const std::vector<Yolov5::Object> &objects, int width, int height,
+                    std::vector<int> &picked)
+    {
+        yolov5.nms_sorted_bboxes(Yolov5::threadContext(), objects, width, height, picked, yolov5.nms_threshold);
+        return;
+    }
+    static void sort(std::vector<Yolov5::Object> &objects)
+    {
+        Yolov5::sort_descent(objects, 0);
+        return;
+    }
+};
+
+/* every kept box against every earlier kept box */
+static void bruteForceNms(const std::vector<Yolov5::Object> &objects, float threshold, bool agnostic,
+                          int maxDetections, std::vector<int> &picked)
+{
+    picked.clear();
+    for (std::size_t i = 0; i < objects.size(); i++) {
+        const Yolov5::Object &a = objects[i];
+        bool keep = true;
+        for (std::size_t k = 0; k < picked.size() && keep; k++) {
+            const Yolov5::Object &b = objects[picked[k]];
+            if (!agnostic && a.label != b.label) {
+                continue;
+            }
+            float inter = (a.rect & b.rect).area();
+            keep = inter/(a.rect.area() + b.rect.area() - inter) <= threshold;
+        }
+        if (!keep) {
+            continue;
+        }
+        picked.push_back(i);
+        if (maxDetections > 0 && (int)picked.size() >= maxDetections) {
+            break;
+        }
+    }
+    return;
+}
+
+void test_argmax()
+{
+    std::vector<Yolov5Test::FnArgmax> kernels = Yolov5Test::argmaxKernels();
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> score(-8.f, 8.f);
+    bool same = true;
+    for (int n = 1; n <= 100 && same; n++) {
+        for (int repeat = 0; repeat < 50 && same; repeat++) {
+            std::vector<float> x(n);
+            for (int k = 0; k < n; k++) {
+                x[k] = score(rng);
+            }
+            if (repeat % 5 == 0) {
+                /* ties: the first position wins */
+                int a = rng() % n;
+                int b = rng() % n;
+                x[a] = x[b] = 9.f;
+            }
+            float expectedValue = 0.f;
+            int expected = kernels[0](x.data(), n, expectedValue);
+            for (std::size_t i = 1; i < kernels.size(); i++) {
+                float value = 0.f;
+                int index = kernels[i](x.data(), n, value);
+                same = same && index == expected && value == expectedValue;
+            }
+        }
+    }
+    check(same, "vector argmax kernels match the scalar one");
+    return;
+}
+
+static std::vector<Yolov5::Object> randomBoxes(std::mt19937 &rng, int count, int width, int height)
+{
+    std::uniform_real_distribution<float> position(-40.f, 680.f);
+    std::uniform_real_distribution<float> size(4.f, 200.f);
+    std::uniform_real_distribution<float> jitter(-12.f, 12.f);
+    std::uniform_real_distribution<float> prob(0.25f, 1.f);
+    std::vector<Yolov5::Object> objects;
+    /* clusters of nearby boxes, as the three strides propose them */
+    while ((int)objects.size() < count) {
+        Yolov5::Object center;
+        center.rect = cv::Rect_<float>(position(rng)*width/640, position(rng)*height/640, size(rng), size(rng));
+        center.label = rng() % 4;
+        int members = 1 + rng() % 12;
+        for (int k = 0; k < members && (int)objects.size() < count; k++) {
+            Yolov5::Object obj = center;
+            obj.rect.x += jitter(rng);
+            obj.rect.y += jitter(rng);
+            obj.rect.width = std::max(1.f, obj.rect.width + jitter(rng));
+            obj.rect.height = std::max(1.f, obj.rect.height + jitter(rng));
+            obj.label = rng() % 3 == 0 ? (int)(rng() % 4) : center.label;
+            obj.prob = prob(rng);
+            objects.push_back(obj);
+        }
+    }
+    Yolov5Test::sort(objects);
+    return objects;
+}
+
+void test_nms()
+{
+    Yolov5 &yolov5 = Yolov5::instance();
+    const bool agnostic = yolov5.agnostic_nms;
+    const int maxDetections = yolov5.max_detections;
+    std::mt19937 rng(11);
+    const int sizes[][2] = {{640, 640}, {640, 384}, {320, 640}};
+    const int caps[] = {0, 300, 20};
+    bool classAware = true;
+    bool classAgnostic = true;
+    bool capped = true;
+    for (const auto &size : sizes) {
+        for (int count : {1, 50, 2000}) {
+            std::vector<Yolov5::Object> objects = randomBoxes(rng, count, size[0], size[1]);
+            for (int cap : caps) {
+                for (int a = 0; a < 2; a++) {
+                    yolov5.agnostic_nms = a != 0;
+                    yolov5.max_detections = cap;
+                    std::vector<int> picked;
+                    std::vector<int> expected;
+                    Yolov5Test::nms(yolov5, objects, size[0], size[1], picked);
+                    bruteForceNms(objects, yolov5.nms_threshold, a != 0, cap, expected);
+                    bool same = picked == expected;
+                    if (cap > 0) {
+                        capped = capped && same;
+                    } else if (a) {
+                        classAgnostic = classAgnostic && same;
+                    } else {
+                        classAware = classAware && same;
+                    }
+                }
+            }
+        }
+    }
+    yolov5.agnostic_nms = agnostic;
+    yolov5.max_detections = maxDetections;
+    check(classAware, "grid nms matches brute force per class");
+    check(classAgnostic, "grid nms matches brute force across classes");
+    check(capped, "grid nms keeps the same first max_detections");
+    return;
+}
+
+int main()
+{
+    test_argmax();
+    test_nms();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <vector>
+#include <jpeglib.h>
+
+/* helpers of the unit tests, one test per executable */
+
+static int failures = 0;
+
+inline void check(bool condition, const char* name)
+{
+    printf("%s: %s\n", condition ? "ok" : "FAILED", name);
+    if (!condition) {
+        failures++;
+    }
+    return;
+}
+
+/* noisy gradient as baseline JPEG, restartRows: DRI of whole MCU rows, else restartInterval MCUs */
+inline std::vector<uint8_t> encodeFrame(int w, int h, int restartRows=0, int restartInterval=0,
+                                        int hSampling=2, int vSampling=2)
+{
+    std::vector<uint8_t> rgb(w*h*3);
+    unsigned int seed = 1;
+    for (std::size_t i = 0; i < rgb.size(); i++) {
+        seed = seed*1103515245 + 12345;
+        rgb[i] = ((i/3)%w + (i/3)/w*2 + (seed >> 28)) & 0xff;
+    }
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char* out = nullptr;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &out, &size);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    cinfo.comp_info[0].h_samp_factor = hSampling;
+    cinfo.comp_info[0].v_samp_factor = vSampling;
+    cinfo.restart_in_rows = restartRows;
+    cinfo.restart_interval = restartInterval;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = &rgb[cinfo.next_scanline*w*3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    std::vector<uint8_t> frame(out, out + size);
+    free(out);
+    jpeg_destroy_compress(&cinfo);
+    return frame;
+}
+
+#endif // TESTUTIL_H